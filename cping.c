@@ -12,19 +12,47 @@
 
 #define VER "2.2.0"
 
+//  Needed for sendmmsg
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <math.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
 #include <sys/time.h>
+#include <time.h>
+#include <errno.h>
 #include <ctype.h>
 #include <arpa/inet.h>
 #include <netdb.h> 
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/ip_icmp.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <getopt.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <linux/filter.h>
+#include <linux/net_tstamp.h>
+#include <linux/sock_diag.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+//  io_uring needs multishot receive (Linux 6.0 headers)
+#ifdef IORING_RECV_MULTISHOT
+#define URING
+#endif
 //  For Windows use PDCurses
 #ifdef __CYGWIN__
 #include "pdcurses.h"
@@ -82,6 +110,10 @@ char* help =
    " ->    Advance time a second\n"
    "  -    Reverse time a minute\n"
    "  +    Advance time a minute\n"
+   "  <    Reverse time an hour\n"
+   "  >    Advance time an hour\n"
+   "  {    Reverse time a day\n"
+   "  }    Advance time a day\n"
    " End   Current time\n"
    "  0    Reset stats\n"
    "ENTER  Traceroute to router\n"
@@ -89,6 +121,7 @@ char* help =
    "  i    Invert colors\n"
    "  r    Reverse direction\n"
    "  t    Toggle time statistics\n"
+   "  w    Stats since reset or last 1/5/60 min\n"
    "  S    Toggle sound for all\n"
    "  s    Toggle sound for selected\n"
    "  a    Toggle address\n"
@@ -104,10 +137,47 @@ char* help =
 #define pTTL 64
 //  Trace TTL
 #define tTTL 24
-//  Max length of ping trace in seconds
-#define nsec 3600
-//  Special ping values
-enum {NoPing=0xFF,LostPing=0xFE,LatePing=0xFD};
+//  Reply timeout (ms)
+#define tmo 1000
+//  Age of a missing reply before it is shown as lost (ms)
+#define tlost 900
+//  Timing wheel tick (ms) and number of slots
+#define WTICK 10
+#define NWHEEL 512
+//  Maximum number of workers
+#define MAXWK 32
+//  Replies queued from each receiver to its sender (power of 2)
+#define NQUEUE 4096
+//  Packets per receive batch and receive buffer size
+#define NRECV 64
+#define RBUF  2048
+//  io_uring provided receive buffers and control data size
+#define NUBUF 1024
+#define RCTL  256
+//  ICMP packet length (header and payload)
+#define PKTLEN sizeof(Echo)
+//  Payload identifier ("cpng") and version
+#define MAGIC  0x63706e67
+#define PAYVER 1
+//  Special ping values (the top byte is dropped for one byte samples)
+enum {NoPing=0xFFFF,LostPing=0xFFFE,LatePing=0xFFFD};
+//  Log scale samples per octave of 10us
+#define SPO 2048
+//  Latency histogram buckets per octave and number of buckets (10us-10s)
+#define QPO 16
+#define NQB (20*QPO)
+//  Rollups of pings per minute for a day and per hour for a month
+#define NMIN  1440
+#define NHOUR 720
+//  Sliding windows of statistics
+#define NWIN  3
+//  History file identifier and header size
+#define DBMAGIC "cpinghst"
+#define DBHDR   64
+//  Archive file identifier, block size and longest time in a block (ms)
+#define ARMAGIC "cpingarc"
+#define ABLK    4096
+#define ASPAN   3600000
 
 typedef struct
 {
@@ -120,12 +190,105 @@ typedef struct
    double std;  // Standard deviation
    int    lost; // Lost packets
    int    late; // Late packets
+   int    nsrc[4]; // Replies by time source
+   uint32_t q[NQB]; // Replies by log scale time (QPO per octave)
 } Stat;
 typedef struct
 {
-   int     cur;       // Current index
-   uint8_t buf[nsec]; // Buffer of replies
+   int      cur;       // Current index
+   int      pend;      // Pings still waiting for a reply
+   uint8_t*  buf;      // Buffer of replies (nsec samples)
+   uint32_t* tim;      // Time of each ping (ms) (nsec)
 } Ping;
+//  Pings in one minute or hour
+typedef struct
+{
+   uint32_t key;  // Minute or hour of the real time
+   uint32_t n;    // Replies
+   uint32_t lost; // Lost pings
+   uint32_t late; // Late replies
+   float    min;  // Minimum ping (ms)
+   float    max;  // Maximum ping (ms)
+   double   sum;  // Sum of pings (ms)
+   double   m2;   // Sum of squared differences from the mean
+} Roll;
+//  Statistics of the last few minutes
+//  Minutes are added as pings arrive and removed as they leave the window
+typedef struct
+{
+   uint32_t key;  // Current minute
+   uint32_t n;    // Replies
+   uint32_t lost; // Lost pings
+   uint32_t late; // Late replies
+   double   mean; // Mean ping (ms)
+   double   m2;   // Sum of squared differences from the mean
+} Win;
+//  Target in the history file followed by its ping history and rollups
+typedef struct
+{
+   in_addr_t ip;   // Target address (0 if free)
+   int       cur;  // Current index in history
+   int       pend; // Pings still waiting for a reply
+   Stat      stat; // Statistics
+} Store;
+//  Header of history file
+typedef struct
+{
+   char     magic[8]; // DBMAGIC
+   uint32_t nsec;     // History length
+   uint32_t fine;     // 16 bit samples
+   uint32_t recsz;    // Bytes per target
+   uint32_t nrec;     // Number of targets
+} DBhdr;
+//  Header of archive file (first block)
+typedef struct
+{
+   char     magic[8]; // ARMAGIC
+   uint32_t blk;      // Block size
+   uint32_t fine;     // 16 bit samples
+} ARhdr;
+//  Archive block header followed by the samples of one target
+//  Each run of equal samples is the change from the previous run and
+//  the run length as varints
+typedef struct
+{
+   int64_t   t0;  // Start of first column (real ms)
+   int64_t   t1;  // End of last column (real ms)
+   in_addr_t ip;  // Target address
+   uint32_t  col; // Column period (ms)
+   uint32_t  n;   // Columns
+   uint32_t  len; // Bytes of runs
+} Block;
+//  Archive block being filled for a target
+typedef struct
+{
+   Block*   b;    // Block (ABLK bytes)
+   uint16_t prev; // Sample of previous run
+   uint16_t val;  // Sample of current run
+   uint32_t nrun; // Length of current run
+} Arch;
+//  Payload of echo request
+//  The time is first since routers may return only 8 bytes in errors
+typedef struct
+{
+   int64_t  t0;    // Time sent (monotonic ns)
+   uint32_t magic; // Payload identifier
+   uint16_t ver;   // Payload version
+   uint16_t hop;   // Traceroute hop (0 for pings)
+   uint32_t idx;   // Target index
+   uint32_t round; // Round number
+} Payload;
+typedef struct
+{
+   struct icmphdr hdr; // ICMP header
+   Payload        pay; // Payload
+} Echo;
+typedef struct
+{
+   uint32_t round; // Round number
+   int64_t sw;  // Software time (ns)
+   int64_t hw;  // Hardware time (ns)
+} Stamp;
 typedef struct
 {
    in_addr_t ip;    // IP address
@@ -140,6 +303,10 @@ typedef struct
    double    dt;   // milliseconds
    Ping      ping; // Ping replies
    Stat      stat; // Statistics
+   Echo      echo; // Packet template
+   Stamp     tx;   // Kernel send time
+   int       src;  // Time source of dt
+   uint32_t  sq;   // Sequence lock (odd while changing)
 } Trace;
 typedef struct
 {
@@ -149,35 +316,112 @@ typedef struct
    int             silent; // Do not beep
    double          dt;     // milliseconds
    Ping            ping;   // Ping replies
+   Roll*           roll;   // Rollups by minute (NMIN) and hour (NHOUR) and windows
+   Store*          rec;    // Record in history file
    Stat            stat;   // Statistics
    int             ttl;    // TTL
    struct in_addr  ip;     // IP address
    struct sockaddr sa;     // Socket address
+   Echo            echo;   // Packet template
+   int             ivl;    // Ping interval (ms)
+   uint32_t        round;  // Ping round number
+   int64_t         due;    // Next ping (wheel tick)
+   int             next;   // Next target in wheel slot
+   Stamp           tx;     // Kernel send time
+   int             src;    // Time source of dt
+   int             wk;     // Worker
+   uint32_t        sq;     // Sequence lock (odd while changing)
 } Target;
+//  Consistent copy of target or hop for display and output
+typedef struct
+{
+   in_addr_t ip;   // IP address
+   double    dt;   // milliseconds
+   int       ttl;  // TTL
+   int       src;  // Time source of dt
+   Stat      stat; // Statistics
+   Win       win;  // Selected sliding window
+} View;
+typedef struct
+{
+   in_addr_t ip;  // IP address (0 is empty)
+   int       idx; // Target index
+} Slot;
+typedef struct
+{
+   int       type;  // 0=ping 1=trace reply 2=time exceeded 3=unreachable
+   int       idx;   // Target or hop
+   uint32_t  round; // Round of the request
+   int       ttl;   // TTL of reply
+   int       src;   // Time source
+   in_addr_t ip;    // Source of reply
+   double    dt;    // Round trip time (ms)
+} Result;
+typedef struct
+{
+   int             id;            // ICMP ID of pings
+   int             sock;          // ICMP socket
+   int             wheel[NWHEEL]; // First target in each wheel slot
+   int*            plist;         // Targets to ping
+   int64_t         tk;            // Next wheel tick
+   uint32_t        drop;          // Kernel receive drops
+   int             ttl;           // Socket TTL
+   int             old[2];        // Ping and trace sockets replaced by a reset
+   int             gen;           // Socket generation of the sender
+   int             ogen;          // Socket generation closed by the receiver
+   int             rst;           // Reset generation applied by the sender
+   int             trc;           // Trace generation applied by the sender
+   Result*         rq;            // Reply queue from receiver to sender
+   uint32_t        qdrop;         // Replies dropped with the queue full
+   uint32_t        qhead __attribute__((aligned(64))); // Next reply written by receiver
+   uint32_t        qtail __attribute__((aligned(64))); // Next reply read by sender
+   pthread_t       snd;           // Send thread
+   pthread_t       rcv;           // Receive thread
+#ifdef __linux__
+   struct mmsghdr* mbat;          // Batch being sent
+#endif
+} Worker;
 
 int     mode=0;       //  Mode 1=traceroute, 0=ping, -1=help
 int     delt=0;       //  Time offset
 int     white=1;      //  White background
-int     sbp=1;        //  Seconds between ping
+double  sbp=1;        //  Seconds between ping
+double  sbc=0;        //  Seconds per display column
 int     r2l=1;        //  Right to left
 int     ntar;         //  Number of targets
 int     nhdr;         //  Number of header lines
 int     sel=0;        //  Selected target
 Target* pt;           //  Ping target
-int     sock;         //  ICMP socket
-int     pingid;       //  PID to identify ping packets
-int     seq;          //  Ping sequence number
+Slot*   hash=0;       //  Targets by IP address
+int     hbits=0;      //  Hash table has 2^hbits slots
+int     nhash=0;      //  Addresses in hash table
+int     sock;         //  ICMP socket of first worker
+int     tsock;        //  Traceroute ICMP socket
+int     kind=0;       //  Socket type 0=auto 1=raw 2=ping
+int     sgen=0;       //  Socket generation (new sockets may reuse descriptors)
+int     rstgen=0;     //  Resets requested with the '0' key
+int     trcgen=0;     //  Traceroute restarts requested by selecting a target
+int     iproto;       //  ICMP protocol number
+int     dgram=0;      //  Using ping sockets
+int     tsmode=0;     //  Timestamps 0=user 1=software 2=hardware
+char*   tsrc="uksh";  //  Time source user, kernel receive, software, hardware
+int     sttl;         //  Traceroute socket TTL
+int*    tttl=&sttl;   //  TTL cache of the traceroute socket
+int     pingid;       //  PID to identify ping packets (first worker)
+int     seq;          //  Ping round number
 int     wid=0;        //  Window width
 int     hgt=0;        //  Window height
 int     top=0;        //  Top entry in display
 int     nping;        //  Number of pings shown
 int     nwid;         //  Name width
 int     awid;         //  Addres width
-pthread_t rd;         //  Read thread
-pthread_t wr;         //  Write thread
 int     show=1;       //  Update display
+int     evmode=0;     //  Single threaded event loop
+int     xport=0;      //  Transport 0=system calls 1=io_uring
+int     nouring=0;    //  io_uring requested but not available
+int     efd=-1;       //  Display update event
 Trace*  tt;           //  Traceroute array
-int     tseq;         //  Trace sequence number
+uint32_t tseq;        //  Trace round number
 int     hop=1;        //  Show hops with ping table
 int     nhop=0;       //  Number of traceroute hops
 int     stat=0;       //  Display ping time stats
@@ -195,17 +439,60 @@ FILE*   fout=0;       //  Output file
 int     num=0;        //  Number of pings before stopping
 int     total=0;      //  Total pings
 int     run=1;        //  Continue running
+int     novr=0;       //  Number of overruns
+int     rcvbuf=0;     //  Socket receive buffer (bytes, 0=default)
+uint32_t tdrop=0;     //  Kernel receive drops on trace socket
+uint32_t bdrop=0;     //  Drops on sockets closed by reset
+int     pint;         //  Default ping interval (ms)
+int     col;          //  Display column period (ms)
+int     hcol;         //  Display columns of history
+int     nsec=3600;    //  Length of ping history (pings)
+int     huge=0;       //  Ping history in huge pages
+int     fine=0;       //  16 bit log scale ping samples
+char*   dbfile=0;     //  History file
+int     wsel=0;       //  Stats window 0=since reset 1-NWIN=last wlen minutes
+int     wlen[NWIN]={1,5,60}; //  Length of sliding windows (minutes)
+char*   afile=0;      //  Archive file
+int     afd=-1;       //  Archive file descriptor
+off_t   aoff;         //  End of archive
+Arch*   arc;          //  Archive blocks being filled
+pthread_t arw;        //  Archive writer thread
+uint32_t ctim;        //  Start of current column (ms)
+uint32_t csq=0;       //  Sequence lock of the column (odd while changing)
+int64_t epoch;        //  Real time minus monotonic time (ns)
+Worker  worker[MAXWK];//  Workers each pinging a slice of the targets
+int     nwk=1;        //  Number of workers
+int64_t origin;       //  Start of pinging (monotonic ns)
+int     pace=0;       //  Ping pacing 0=burst 1=spread 2=jitter
+int     nbat=1;       //  Pings per batch
+#ifdef __linux__
+struct mmsghdr* mmsg; //  Batch of ping messages
+struct iovec*   miov; //  Ping packet vectors
+#endif
+
+//
+//  Total kernel receive drops
+//
+uint32_t Drops()
+{
+   uint32_t n = bdrop+tdrop;
+   for (int w=0;w<nwk;w++)
+      n += worker[w].drop+worker[w].qdrop;
+   return n;
+}
 
 //
 //  Current time (double)
 //
 void timeprint(void)
 {
-   time_t t =  time(NULL)-delt;
+   time_t t =  time(NULL)-(time_t)delt*col/1000;
    struct tm*  l = localtime(&t);
    printw("%4d-%.2d-%.2d %.2d:%.2d:%.2d",l->tm_year+1900,l->tm_mon+1,l->tm_mday,l->tm_hour,l->tm_min,l->tm_sec);
    if (delt) printw(" dt=%d",delt);
-   printw("   #%d  Period %ds Ping time",seq,sbp);
+   printw("   #%d  Period %gs",seq,col/1000.0);
+   if (pint!=col) printw(" Interval %gs",pint/1000.0);
+   printw(" Ping time");
    if (ich==3)
    {
       attron(A_BOLD);
@@ -235,6 +522,16 @@ void timeprint(void)
       attron(COLOR_PAIR(5));
       printw(" SILENT");
    }
+   if (novr)
+   {
+      attron(COLOR_PAIR(5));
+      printw(" OVERRUN %d",novr);
+   }
+   if (Drops())
+   {
+      attron(COLOR_PAIR(5));
+      printw(" DROP %u",Drops());
+   }
    attron(COLOR_PAIR(1));
    printw("\n");
 }
@@ -249,6 +546,49 @@ double now(void)
    return tv.tv_sec + ((double)tv.tv_usec)/1000000;
 }
 
+//
+//  Monotonic time (ns)
+//
+int64_t nsnow(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC,&ts);
+   return ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+//
+//  Time in ms used for the ping history
+//  Follows the real time at startup but never jumps
+//  Wraps every 49 days so compare differences only
+//
+uint32_t mstime(int64_t t)
+{
+   return (t+epoch)/1000000;
+}
+
+//
+//  Full real time (ms) of ping time t given the time now
+//
+static inline int64_t msfull(uint32_t t,int64_t now)
+{
+   return now - (uint32_t)((uint32_t)now-t);
+}
+
+//
+//  Sleep until monotonic time (ns)
+//
+void SleepUntil(int64_t t)
+{
+#ifdef TIMER_ABSTIME
+   struct timespec ts = {t/1000000000,t%1000000000};
+   while (clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&ts,NULL)==EINTR);
+#else
+   //  OSX has no absolute sleep
+   int64_t dt = t-nsnow();
+   if (dt>0) usleep(dt/1000);
+#endif
+}
+
 //
 //  Print error and exit
 //
@@ -281,11 +621,11 @@ void InitDNS()
 //
 //  Look up DNS address with local cache
 //
-int nslookup(Trace* tr)
+int nslookup(Trace* tr,in_addr_t ip)
 {
    //  Look up IP address
    for (int k=0;k<ndns;k++)
-      if (tr->ip == dns[k].ip)
+      if (ip == dns[k].ip)
       {
          tr->addr = dns[k].addr;
          tr->fqdn = dns[k].fqdn;
@@ -300,13 +640,13 @@ int nslookup(Trace* tr)
       if (!dns) Fatal("Cannot allocate DNS memory");
    }
    //  Set IP
-   dns[k].ip = tr->ip;
+   dns[k].ip = ip;
    char addr[16];
-   inet_ntop(AF_INET,&tr->ip,addr,16);
+   inet_ntop(AF_INET,&ip,addr,16);
    tr->addr = dns[k].addr = malloc(16);
    strcpy(dns[k].addr,addr);
    //  Look up hostname
-   struct hostent* he = gethostbyaddr((char*)&tr->ip,sizeof(in_addr_t),AF_INET);
+   struct hostent* he = gethostbyaddr((char*)&ip,sizeof(in_addr_t),AF_INET);
    if (he)
    {
       tr->fqdn = dns[k].fqdn = malloc(strlen(he->h_name)+1);
@@ -332,6 +672,108 @@ void InitStat(Stat* stat)
    stat->std  = -1;
    stat->lost = -1;
    stat->late =  0;
+   for (int i=0;i<4;i++)
+      stat->nsrc[i] = 0;
+   memset(stat->q,0,sizeof(stat->q));
+}
+
+//
+//  Add statistics b to a
+//  Histograms add, so targets, hops or periods can be combined
+//
+void MergeStat(Stat* a,Stat* b)
+{
+   if (!b->n && b->lost<=0 && !b->late) return;
+   if (b->n && (a->min<0 || b->min<a->min)) a->min = b->min;
+   if (b->n && (a->max<0 || b->max>a->max)) a->max = b->max;
+   a->n  += b->n;
+   a->S  += b->S;
+   a->S2 += b->S2;
+   if (b->lost>0) a->lost = (a->lost>0 ? a->lost : 0) + b->lost;
+   a->late += b->late;
+   for (int i=0;i<4;i++)
+      a->nsrc[i] += b->nsrc[i];
+   for (int i=0;i<NQB;i++)
+      a->q[i] += b->q[i];
+   if (a->n)
+   {
+      a->avg = a->S / a->n;
+      a->std = (a->n > 1) ? sqrt((a->S2-a->S*a->S/a->n)/(a->n-1)) : 0;
+   }
+}
+
+//
+//  Time (ms) below which a fraction p of the replies fall
+//  The middle of the histogram bucket is within 2.2% of the time
+//
+double Quantile(Stat* stat,double p)
+{
+   if (!stat->n) return -1;
+   uint32_t k = p*stat->n;
+   if (k>=stat->n) k = stat->n-1;
+   int b=0;
+   for (uint32_t c=stat->q[0];c<=k && b<NQB-1;c+=stat->q[++b]);
+   double v = 0.01*exp2((b+0.5)/QPO);
+   return v<stat->min ? stat->min : v>stat->max ? stat->max : v;
+}
+
+//
+//  Encode time as byte
+//  Upper nibble exponent base 10
+//  Lower nibble mantissa 0-9
+//     Example 0x25 = 500
+//  Special values
+//     0xFF - NoPing
+//     0xFE - Lost ping
+//     0xFD - Late ping
+//
+uint16_t ByteTime(double dt)
+{
+   int idt = dt+0.5;
+   uint16_t bdt=LostPing;
+   if (idt<10)
+      bdt = idt;
+   else if (idt<100)
+      bdt = (idt/10) + 0x10;
+   else if (idt<1000)
+      bdt = (idt/100) + 0x20;
+   else if (idt<10000)
+      bdt = (idt/1000) + 0x30;
+   return bdt;
+}
+
+//
+//  Encode time as 16 bit log scale sample
+//  2048 steps per octave above 10us (0.03%) up to about 12 hours
+//  so times over 10s are kept instead of being lost
+//
+uint16_t LogTime(double dt)
+{
+   if (dt<=0.01) return 0;
+   double v = SPO*log2(dt*100)+0.5;
+   return v<LatePing ? v : LatePing-1;
+}
+
+//
+//  Encode time as ping sample in the history format
+//
+static inline uint16_t Sample(double dt)
+{
+   return fine ? LogTime(dt) : ByteTime(dt);
+}
+
+//
+//  Time (ms) of ping sample
+//  One byte samples give the lower end of the range
+//
+double SampleTime(uint16_t s)
+{
+   if (s>=LatePing)
+      return -1;
+   else if (fine)
+      return 0.01*exp2((double)s/SPO);
+   else
+      return (s&0xF)*pow(10,s>>4);
 }
 
 //
@@ -339,973 +781,3696 @@ void InitStat(Stat* stat)
 //
 void InitPing(Ping* ping)
 {
-   ping->cur = nsec-1;
-   for (int i=0;i<nsec;i++)
-      ping->buf[i] = NoPing;
+   ping->cur  = nsec-1;
+   ping->pend = 0;
+   memset(ping->buf,0xFF,(size_t)nsec*(fine?2:1));
+   memset(ping->tim,0,(size_t)nsec*sizeof(uint32_t));
 }
 
 //
 //  Set pings
 //
-static inline void SetPing(Ping* ping,int off,uint8_t val)
+static inline void SetPing(Ping* ping,int off,uint16_t val)
 {
    int k = (ping->cur+off) % nsec;
-   ping->buf[k] = val;
+   if (fine)
+      ((uint16_t*)ping->buf)[k] = val;
+   else
+      ping->buf[k] = val;
 }
 
 //
 //  Get pings
 //
-static inline uint8_t GetPing(Ping* ping,int off)
+static inline uint16_t GetPing(Ping* ping,int off)
 {
-   int k = (ping->cur+off+delt) % nsec;
-   return ping->buf[k];
+   int k = (ping->cur+off) % nsec;
+   if (fine) return ((uint16_t*)ping->buf)[k];
+   uint8_t b = ping->buf[k];
+   return b>=(LatePing&0xFF) ? 0xFF00|b : b;
 }
 
 //
-//  Initialize traceroute
+//  Get time of ping
 //
-void InitTrace()
+static inline uint32_t GetTime(Ping* ping,int off)
 {
-   tseq=0;
-   for (int k=0;k<tTTL;k++)
+   int k = (ping->cur+off) % nsec;
+   return ping->tim[k];
+}
+
+//
+//  Worst of two pings (lost, late, slowest)
+//
+static inline uint16_t Worst(uint16_t a,uint16_t b)
+{
+   if (a==NoPing) return b;
+   if (b==NoPing) return a;
+   return a>b ? a : b;
+}
+
+//
+//  Sequence locks
+//  The owner makes the count odd while it changes an entry.  Readers copy
+//  the entry and try again if the count changed, so the owner never waits.
+//
+static inline void SeqWrite(uint32_t* sq)
+{
+   __atomic_store_n(sq,*sq+1,__ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+static inline void SeqDone(uint32_t* sq)
+{
+   __atomic_store_n(sq,*sq+1,__ATOMIC_RELEASE);
+}
+static inline uint32_t SeqRead(uint32_t* sq)
+{
+   uint32_t s;
+   while ((s=__atomic_load_n(sq,__ATOMIC_ACQUIRE))&1)
+      sched_yield();
+   return s;
+}
+static inline int SeqRetry(uint32_t* sq,uint32_t s)
+{
+   __atomic_thread_fence(__ATOMIC_ACQUIRE);
+   return __atomic_load_n(sq,__ATOMIC_RELAXED)!=s;
+}
+
+//
+//  Sliding windows follow the rollups of a target
+//
+static inline Win* Wins(Roll* roll)
+{
+   return (Win*)(roll+NMIN+NHOUR);
+}
+
+//
+//  Add ping to window (Welford)
+//     what - 0=reply 1=lost 2=late
+//
+void WinAdd(Win* w,int what,double dt)
+{
+   if (what==1)
+      w->lost++;
+   else if (what==2)
+      w->late++;
+   else
    {
-      InitStat(&tt[k].stat);
-      InitPing(&tt[k].ping);
+      double d = dt-w->mean;
+      w->n++;
+      w->mean += d/w->n;
+      w->m2   += d*(dt-w->mean);
    }
 }
 
 //
-//  Read configuration file
+//  Remove minute r from window
+//  Undoes the merge of two sets of pings with their means and m2
 //
-void ReadConfig(char* file[],const int nfile)
+void WinDrop(Win* w,Roll* r)
 {
-   char line[1024];
-   int maxn=0;
+   w->lost -= r->lost;
+   w->late -= r->late;
+   if (!r->n) return;
+   uint32_t n = w->n-r->n;
+   if (!n)
+   {
+      w->n    = 0;
+      w->mean = 0;
+      w->m2   = 0;
+      return;
+   }
+   double mb = r->sum/r->n;
+   double ma = (w->n*w->mean-r->n*mb)/n;
+   double d  = mb-ma;
+   w->m2  -= r->m2 + d*d*n*r->n/w->n;
+   if (w->m2<0) w->m2 = 0;
+   w->mean = ma;
+   w->n    = n;
+}
 
-   //  Initialize
-   ntar = 0;
-   nhdr = 0;
-   seq  = 0;
-   nwid = 6;  //  Minimum width
-   awid = 6;  //  Addres width
-   //  Initialize Traceroute array (max number of entries it tTTL)
-   tt = (Trace*)malloc(tTTL*sizeof(Trace));
-   //  Open first file in the list that is readable
-   FILE* f=0;
-   for (int k=0;k<nfile && !f;k++)
-      f = fopen(file[k],"r");
-   //  Cannot open any of the files
-   if (!f)
+//
+//  Move windows of target to minute key
+//  Minutes that fall out of a window are removed using their rollup,
+//  so the cost does not depend on the number of pings
+//
+void WinMove(Roll* roll,uint32_t key)
+{
+   Win* win = Wins(roll);
+   for (int i=0;i<NWIN;i++)
    {
-      fprintf(stderr,"Cannot open file %s",file[0]);
-      for (int k=1;k<nfile;k++)
-         fprintf(stderr," or %s",file[k]);
-      Fatal("\n");
+      Win* w = win+i;
+      if (w->key==key) continue;
+      //  Everything left the window
+      if (key-w->key>=wlen[i])
+         memset(w,0,sizeof(Win));
+      else
+         for (uint32_t x=w->key-wlen[i]+1;x!=key-wlen[i]+1;x++)
+            if (roll[x%NMIN].key==x) WinDrop(w,roll+x%NMIN);
+      w->key = key;
    }
-   //  
-   //  Read first 3 characters to check BOM
-   unsigned char magic[3];
-   if (fread(magic,1,3,f)==3 && magic[0]==0xEF && magic[1]==0xBB && magic[2]==0xBF)
-      fprintf(stderr,"WARNING: UTF-8 file treated as ASCII\n");
-   else
-      rewind(f);
+}
 
-   //  Read line
-   int  indent=0;
-   char* hdr=0;
-   while (fgets(line,sizeof(line),f) != NULL )
+//
+//  Add ping sent at time t to the minute and hour rollups
+//     what - 0=reply 1=lost 2=late
+//
+void Rollup(Roll* roll,uint32_t t,int what,double dt)
+{
+   int64_t now = (nsnow()+epoch)/1000000;
+   int64_t ms  = msfull(t,now);
+   for (int i=0;i<2;i++)
    {
-      char host[256];
-      //  Skip comments
-      if (line[0] == '#') continue;
-      //  Trim trailing whitespace
-      int l=strlen(line)-1;
-      while (l>0 && isspace((int)line[l-1])) l--;
-      line[l] = 0;
-      //  Skip blank lines
-      if (l==0) continue;
-      //  Header line
-      if (line[0] == '>')
-      {
-         //  Reset indent
-         if (l==1 && indent>0)
-            hdr = 0;
-         //  Add header
-         else
-         {
-            nhdr++;
-            hdr = malloc(l+1);
-            memcpy(hdr,line+1,l);
-         }
-         indent = l>1?3:0;
-         continue;
-      }
-      //  Next target
-      if (ntar+1>maxn)
-      {
-         maxn += 32;
-         pt = (Target*)realloc(pt,maxn*sizeof(Target));
-         if (!pt) Fatal("Out of memory allocating ping targets\n");
-      }
-      //  Set header
-      pt[ntar].hdr = hdr;
-      if (hdr) hdr = 0;
-      //  Get hostname/ip and offset to start of display name
-      int i;
-      if (sscanf(line,"%255s %n",host,&i)!=1) Fatal("Error reading address: %s\n",line);
-      //  Save display name and host name
-      if (l>i)
+      uint32_t key = i ? ms/3600000 : ms/60000;
+      Roll*    r   = i ? roll+NMIN+key%NHOUR : roll+key%NMIN;
+      //  Slot last used for an earlier period
+      if (r->key!=key)
       {
-         //  Display name
-         l = l-i+indent;
-         pt[ntar].name = malloc(l+1);
-         for (int j=0;j<indent;j++)
-            pt[ntar].name[j] = ' ';
-         memcpy(pt[ntar].name+indent,line+i,l-indent+1);
-         if (l>nwid) nwid = l;
-         //  Hostname
-         l = strlen(host);
-         pt[ntar].host = malloc(l+1);
-         memcpy(pt[ntar].host,host,l+1);
-         if (l>awid) awid = l;
+         memset(r,0,sizeof(Roll));
+         r->key = key;
       }
-      //  Use host name as display name
+      if (what==1)
+         r->lost++;
+      else if (what==2)
+         r->late++;
       else
       {
-         l = strlen(host)+indent;
-         pt[ntar].name = malloc(l+1);
-         for (int j=0;j<indent;j++)
-            pt[ntar].name[j] = ' ';
-         memcpy(pt[ntar].name+indent,host,l+1-indent);
-         if (l>nwid) nwid = l;
-         //  Blank host name
-         pt[ntar].host = malloc(1);
-         pt[ntar].host[0] = 0;
+         if (!r->n || dt<r->min) r->min = dt;
+         if (!r->n || dt>r->max) r->max = dt;
+         double d = r->n ? dt-r->sum/r->n : 0;
+         r->n++;
+         r->sum += dt;
+         r->m2  += d*(dt-r->sum/r->n);
       }
-      //  Enable beep
-      pt[ntar].silent = 0;
-      //  Initialize pings
-      pt[ntar].dt = -1;
-      InitPing(&pt[ntar].ping);
-      InitStat(&pt[ntar].stat);
-      //  Get IP address
-      struct hostent* he = gethostbyname(host);
-      if (!he) Fatal("Cannot resolve host name %s\n",host);
-      memcpy(&pt[ntar].ip.s_addr,he->h_addr_list[0],4);
-      //  Set up sa as an IP socket
-      memset(&pt[ntar].sa,0,sizeof(struct sockaddr));
-      struct sockaddr_in *isa = (struct sockaddr_in*)&pt[ntar].sa;
-      isa->sin_family = AF_INET;
-      isa->sin_addr.s_addr = pt[ntar].ip.s_addr;
-      //  Check for duplicate IP addresses
-      for (i=0;i<ntar;i++)
-         if (pt[ntar].ip.s_addr==pt[i].ip.s_addr)
-           Fatal("%s has a duplicate IP\n",pt[ntar].name);
-      //  Increment ntar
-      ntar++;
    }
-   fclose (f);
-   if (!ntar) Fatal("No targets in %s\n",file);
-   //  Write header
-   if (fout)
+   //  Add to windows that still hold the minute
+   uint32_t key = ms/60000;
+   Win*     win = Wins(roll);
+   WinMove(roll,now/60000);
+   for (int i=0;i<NWIN;i++)
+      if (win[i].key-key<wlen[i])
+         WinAdd(win+i,what,dt);
+}
+
+//
+//  Worst ping of rollups from t0 to t1 (real time ms)
+//  Minutes are used for the last day and hours before that
+//
+uint16_t RollPing(Roll* roll,int64_t t0,int64_t t1)
+{
+   uint16_t v = NoPing;
+   int64_t  step = (t1-t0>=3600000) ? 3600000 : 60000;
+   for (int64_t x=t0/step;x*step<t1;x++)
    {
-      for (int i=0;i<ntar;i++)
-      {
-         if (pt[i].hdr) fprintf(fout,"#                    %s\n",pt[i].hdr);
-         fprintf(fout,"#%-3d %-15s %s\n",i+1,pt[i].host,pt[i].name);
-      }
-      fprintf(fout,"#\n");
-      fprintf(fout,"#  Date      Time  ");
-      for (int i=0;i<ntar;i++)
-         fprintf(fout," %6d",i+1);
-      fprintf(fout,"\n");
+      Roll* r = NULL;
+      if (step==60000 && roll[x%NMIN].key==x)
+         r = roll+x%NMIN;
+      else if (roll[NMIN+x*step/3600000%NHOUR].key==x*step/3600000)
+         r = roll+NMIN+x*step/3600000%NHOUR;
+      if (!r) continue;
+      if (r->lost>r->late)
+         v = Worst(v,LostPing);
+      else if (r->late)
+         v = Worst(v,LatePing);
+      else if (r->n)
+         v = Worst(v,Sample(r->max));
    }
+   return v;
 }
 
 //
-//  Calculate checksum
+//  Full real time (ms) of ping
 //
-unsigned short checksum(char* data,int len)
+static inline int64_t PingTime(Ping* ping,int off,int64_t now)
 {
-   int sum = 0;
-   unsigned short csum = 0;
-   unsigned short* word = (unsigned short*) data;
-   while (len>1)
+   return msfull(GetTime(ping,off),now);
+}
+
+//
+//  Number of pings in the history
+//  The history fills from the newest so the empty slots are at the end
+//
+int PingCount(Ping* ping)
+{
+   int lo=0,hi=nsec;
+   while (lo<hi)
    {
-     sum += *word++;
-     len -= 2;
+      int m = lo+(hi-lo)/2;
+      if (GetPing(ping,m)!=NoPing)
+         lo = m+1;
+      else
+         hi = m;
    }
-   if (len==1)
+   return lo;
+}
+
+//
+//  First of the m newest pings sent before t (real time ms)
+//  Ping times decrease with the offset so this is a binary search
+//
+int PingFind(Ping* ping,int m,int64_t t,int64_t now)
+{
+   int lo=0,hi=m;
+   while (lo<hi)
    {
-     *(unsigned char *)(&csum) = *(unsigned char *)word;
-     sum += csum;
+      int k = lo+(hi-lo)/2;
+      if (PingTime(ping,k,now)>=t)
+         lo = k+1;
+      else
+         hi = k;
    }
-   sum = (sum >> 16) + (sum & 0xffff);  // add hi 16 to low 16
-   sum += (sum >> 16);                  // add carry
-   csum = ~sum;                         // truncate to 16 bits
-   return csum;
+   return lo;
 }
 
 //
-//  Draw single ping
+//  Map ping history with interval ivl (ms) to n display columns
+//  A column shows the worst ping sent in that period
+//  Targets pinged less often than once a column repeat the last ping
+//  Columns before the oldest ping in the history come from the rollups
+//     t1 - end of the first column (real time ms)
 //
-void DrawPing(Ping* ping,int l)
+void PingRow(Ping* ping,Roll* roll,int ivl,int64_t t1,uint16_t val[],int n)
 {
-   uint8_t ch = GetPing(ping,l);
-   //  No ping yet
-   if (ch==NoPing)
+   if (n<1) return;
+   int64_t now = (nsnow()+epoch)/1000000;
+   //  Oldest ping when the history is full
+   int m = PingCount(ping);
+   int full = (m==nsec);
+   int64_t old = full ? PingTime(ping,nsec-1,now) : 0;
+   //  Skip pings after the first column
+   int k = PingFind(ping,m,t1,now);
+   for (int l=0;l<n;l++,t1-=col)
    {
-      attron(COLOR_PAIR(1));
-      addch('-');
+      int64_t  t0 = t1-col;
+      uint16_t v  = NoPing;
+      //  Worst ping in this column ignoring pings still in flight
+      int j=k;
+      for (;j<m && PingTime(ping,j,now)>=t0;j++)
+         if (GetPing(ping,j)!=LostPing || now-PingTime(ping,j,now)>=tlost)
+            v = Worst(v,GetPing(ping,j));
+      //  Repeat last ping if the interval spans this column
+      if (j==k && k<m && t0-PingTime(ping,k,now)<ivl)
+         v = (GetPing(ping,k)!=LostPing || now-PingTime(ping,k,now)>=tlost) ? GetPing(ping,k) : NoPing;
+      //  Older than the history
+      if (roll && full && t1<=old)
+         v = RollPing(roll,t0,t1);
+      val[l] = v;
+      k = j;
    }
-   //  No reply or late reply
-   else if (ch==LostPing || ch==LatePing)
+}
+
+//
+//  End of the first display column (real time ms) back columns ago
+//
+int64_t ColEnd(int back)
+{
+   int64_t now = (nsnow()+epoch)/1000000;
+   return msfull(ctim,now)+col-(int64_t)back*col;
+}
+
+//
+//  Read target and n display columns of its pings ending at t1
+//
+void ReadTarget(Target* t,View* v,uint16_t val[],int n,int64_t t1)
+{
+   uint32_t s;
+   do
    {
-      attron(COLOR_PAIR(5));
-      attron(A_BOLD);
-      addch(ch==LostPing?'X':'+');
-      attroff(A_BOLD);
+      s = SeqRead(&t->sq);
+      PingRow(&t->ping,t->roll,t->ivl,t1,val,n);
+      v->ip   = t->ip.s_addr;
+      v->dt   = t->dt;
+      v->ttl  = t->ttl;
+      v->src  = t->src;
+      v->stat = t->stat;
+      if (wsel) v->win = Wins(t->roll)[wsel-1];
+   } while (SeqRetry(&t->sq,s));
+}
+
+//
+//  Read traceroute hop and n display columns of its pings ending at t1
+//
+void ReadTrace(Trace* t,View* v,uint16_t val[],int n,int64_t t1)
+{
+   uint32_t s;
+   do
+   {
+      s = SeqRead(&t->sq);
+      PingRow(&t->ping,NULL,col,t1,val,n);
+      v->ip   = t->ip;
+      v->dt   = t->dt;
+      v->ttl  = 0;
+      v->src  = t->src;
+      v->stat = t->stat;
+   } while (SeqRetry(&t->sq,s));
+}
+
+//
+//  Bytes of one ping history (aligned)
+//
+size_t RingSize()
+{
+   return ((size_t)nsec*(sizeof(uint32_t)+(fine?2:1))+7) & ~7;
+}
+
+//
+//  Bytes of one target record with history, rollups and windows
+//
+size_t RecSize()
+{
+   return ((sizeof(Store)+7)&~7) + RingSize() + (NMIN+NHOUR)*sizeof(Roll) + NWIN*sizeof(Win);
+}
+
+//
+//  Point ping history at memory (times first to keep them aligned)
+//
+void MapPing(Ping* ping,char* mem)
+{
+   ping->tim = (uint32_t*)mem;
+   ping->buf = (uint8_t*)(mem+(size_t)nsec*sizeof(uint32_t));
+}
+
+//
+//  Save ping position and stats of target to its record
+//
+void Save(Target* t)
+{
+   if (!t->rec) return;
+   t->rec->cur  = t->ping.cur;
+   t->rec->pend = t->ping.pend;
+   t->rec->stat = t->stat;
+}
+
+//
+//  Attach target to record
+//     init - start a new history (otherwise continue the saved one)
+//
+void Attach(Target* t,Store* rec,int init)
+{
+   char* mem = (char*)rec + ((sizeof(Store)+7)&~7);
+   t->rec = dbfile ? rec : NULL;
+   MapPing(&t->ping,mem);
+   t->roll = (Roll*)(mem+RingSize());
+   if (init)
+   {
+      rec->ip = t->ip.s_addr;
+      InitPing(&t->ping);
+      memset(t->roll,0,(NMIN+NHOUR)*sizeof(Roll)+NWIN*sizeof(Win));
    }
-   // Reply
    else
    {
-      //  Upper nibble is exponent (color)
-      attron(COLOR_PAIR((ch>>4)+2));
-      //  Numeric
-      if (ich==3)
+      t->ping.cur  = rec->cur;
+      t->ping.pend = rec->pend;
+      t->stat      = rec->stat;
+   }
+   Save(t);
+}
+
+int HashFind(in_addr_t ip);
+
+//
+//  Map history file and attach targets to their records by address
+//  Records of targets no longer in the configuration are freed and new
+//  targets reuse them or are added at the end
+//
+void OpenStore()
+{
+   int fd = open(dbfile,O_RDWR|O_CREAT,0644);
+   if (fd<0) Fatal("Cannot open history file %s\n",dbfile);
+   if (flock(fd,LOCK_EX|LOCK_NB)<0) Fatal("History file %s is in use\n",dbfile);
+   size_t rsz = RecSize();
+   //  Check layout
+   DBhdr hdr;
+   off_t size = lseek(fd,0,SEEK_END);
+   if (size<0) Fatal("Cannot read history file %s\n",dbfile);
+   if (size==0)
+   {
+      memset(&hdr,0,sizeof(hdr));
+      memcpy(hdr.magic,DBMAGIC,8);
+      hdr.nsec  = nsec;
+      hdr.fine  = fine;
+      hdr.recsz = rsz;
+   }
+   else if (pread(fd,&hdr,sizeof(hdr),0)!=sizeof(hdr) || memcmp(hdr.magic,DBMAGIC,8))
+      Fatal("%s is not a cping history file\n",dbfile);
+   else if (hdr.nsec!=nsec || hdr.fine!=fine)
+      Fatal("History file %s was written with -H %u%s\n",dbfile,hdr.nsec,hdr.fine?" -F":"");
+   else if (hdr.recsz!=rsz)
+      Fatal("History file %s was written by another version of cping\n",dbfile);
+   //  Match records to targets
+   int  nrec = hdr.nrec;
+   int  need = ntar;
+   int* map  = (int*)malloc(ntar*sizeof(int));
+   if (!map) Fatal("Cannot allocate history map\n");
+   for (int k=0;k<ntar;k++)
+      map[k] = -1;
+   for (int i=0;i<nrec;i++)
+   {
+      in_addr_t ip;
+      if (pread(fd,&ip,sizeof(ip),DBHDR+i*rsz)!=sizeof(ip)) Fatal("History file %s is truncated\n",dbfile);
+      int k = ip ? HashFind(ip) : -1;
+      if (k>=0)
       {
-         //  Lower nibble is mantissa (0-9)
-         attron(A_BOLD);
-         addch((ch&0xF)+'0');
-         attroff(A_BOLD);
+         map[k] = i;
+         need--;
       }
-      //  Symbol
-      else if (pch)
-         addch(pch);
-      else if (ich==2)
-         addch('*');
-      else if (ich==1)
-         addch(ACS_BLOCK);
+   }
+   //  Grow for new targets
+   if (need>0)
+   {
+      int nfree=0;
+      for (int i=0;i<nrec;i++)
+      {
+         in_addr_t ip;
+         if (pread(fd,&ip,sizeof(ip),DBHDR+i*rsz)==sizeof(ip) && (!ip || HashFind(ip)<0)) nfree++;
+      }
+      if (need>nfree) nrec += need-nfree;
+   }
+   size_t len = DBHDR+nrec*rsz;
+   if (ftruncate(fd,len)<0) Fatal("Cannot extend history file %s\n",dbfile);
+   hdr.nrec = nrec;
+   if (pwrite(fd,&hdr,sizeof(hdr),0)!=sizeof(hdr)) Fatal("Cannot write history file %s\n",dbfile);
+   char* mem = mmap(NULL,len,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+   if (mem==MAP_FAILED) Fatal("Cannot map history file %s\n",dbfile);
+   //  Free records of removed targets
+   for (int i=0;i<nrec;i++)
+   {
+      Store* rec = (Store*)(mem+DBHDR+i*rsz);
+      if (rec->ip && HashFind(rec->ip)<0) rec->ip = 0;
+   }
+   //  Attach targets continuing their history or in a free record
+   int i=0;
+   for (int k=0;k<ntar;k++)
+   {
+      if (map[k]>=0)
+         Attach(pt+k,(Store*)(mem+DBHDR+map[k]*rsz),0);
       else
-         addch(ACS_DIAMOND);
+      {
+         while (((Store*)(mem+DBHDR+i*rsz))->ip) i++;
+         Attach(pt+k,(Store*)(mem+DBHDR+i*rsz),1);
+      }
    }
+   free(map);
 }
 
 //
-//  Draw row of pings
+//  Allocate ping history of hops and of targets unless they are kept in
+//  a history file in one region
+//  Huge pages must be reserved (vm.nr_hugepages) so otherwise ask for
+//  transparent huge pages
 //
-void DrawPingRow(Ping* ping,int n)
+void InitHistory()
 {
-   if (r2l)
-      for (int l=n-1;l>=0;l--)
-         DrawPing(ping,l);
+   int    n   = dbfile ? 0 : ntar;
+   size_t len = tTTL*RingSize() + n*RecSize();
+   void*  mem = MAP_FAILED;
+#ifdef MAP_HUGETLB
+   if (huge)
+   {
+      size_t hp = 2<<20;
+      mem = mmap(NULL,(len+hp-1)/hp*hp,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB,-1,0);
+   }
+#endif
+   if (mem==MAP_FAILED)
+   {
+      mem = mmap(NULL,len,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+      if (mem==MAP_FAILED) Fatal("Cannot allocate %zu MB of ping history\n",len>>20);
+#ifdef MADV_HUGEPAGE
+      if (huge) madvise(mem,len,MADV_HUGEPAGE);
+#endif
+   }
+   for (int k=0;k<tTTL;k++)
+   {
+      MapPing(&tt[k].ping,(char*)mem+k*RingSize());
+      InitPing(&tt[k].ping);
+   }
+   //  Targets in the history file
+   if (dbfile)
+      OpenStore();
+   //  Targets in memory
    else
-      for (int l=0;l<n;l++)
-         DrawPing(ping,l);
+      for (int k=0;k<n;k++)
+         Attach(pt+k,(Store*)((char*)mem+tTTL*RingSize()+k*RecSize()),1);
 }
 
 //
-//  Figure out the bottom row
+//  Write varint
 //
-int Bottom(int top)
+static inline int PutVar(uint8_t* p,uint32_t v)
 {
-   int i = (ntar+nhdr+1<hgt || hgt>20) ? 2 : 1;
-   for (int k=top;k<ntar;k++)
+   int n=0;
+   for (;v>=0x80;v>>=7)
+      p[n++] = v|0x80;
+   p[n++] = v;
+   return n;
+}
+
+//
+//  Read varint (0 past the end)
+//
+static inline uint32_t GetVar(uint8_t** p,uint8_t* end)
+{
+   uint32_t v=0;
+   for (int s=0;*p<end && s<32;s+=7)
    {
-      i += pt[k].hdr ? 2 : 1;
-      if (i==hgt)
-         return k;
-      else if (i>hgt)
-         return k-1;
+      uint8_t b = *(*p)++;
+      v |= (uint32_t)(b&0x7F)<<s;
+      if (!(b&0x80)) break;
    }
-   return ntar-1;
+   return v;
 }
 
 //
-//  Print history header
+//  Open archive and check it matches -F
+//  A partly written block at the end is dropped
 //
-void PrintHist(int n)
+void OpenArchive()
 {
-   //  Ping history header right to left
-   if (r2l)
-      for (int l=n-1;l>=0;l--)
+   afd = open(afile,O_RDWR|O_CREAT,0644);
+   if (afd<0) Fatal("Cannot open archive %s\n",afile);
+   if (flock(afd,LOCK_EX|LOCK_NB)<0) Fatal("Archive %s is in use\n",afile);
+   ARhdr hdr;
+   aoff = lseek(afd,0,SEEK_END);
+   if (aoff<0) Fatal("Cannot read archive %s\n",afile);
+   if (aoff<ABLK)
+   {
+      char buf[ABLK];
+      memset(buf,0,ABLK);
+      memset(&hdr,0,sizeof(hdr));
+      memcpy(hdr.magic,ARMAGIC,8);
+      hdr.blk  = ABLK;
+      hdr.fine = fine;
+      memcpy(buf,&hdr,sizeof(hdr));
+      if (pwrite(afd,buf,ABLK,0)!=ABLK) Fatal("Cannot write archive %s\n",afile);
+      aoff = ABLK;
+   }
+   else if (pread(afd,&hdr,sizeof(hdr),0)!=sizeof(hdr) || memcmp(hdr.magic,ARMAGIC,8) || hdr.blk!=ABLK)
+      Fatal("%s is not a cping archive\n",afile);
+   else if (hdr.fine!=fine)
+      Fatal("Archive %s was written %s -F\n",afile,hdr.fine?"with":"without");
+   aoff -= aoff%ABLK;
+   //  Blocks being filled
+   arc = (Arch*)calloc(ntar,sizeof(Arch));
+   if (!arc) Fatal("Cannot allocate archive\n");
+   for (int k=0;k<ntar;k++)
+   {
+      arc[k].b = (Block*)calloc(1,ABLK);
+      if (!arc[k].b) Fatal("Cannot allocate archive\n");
+   }
+}
+
+//
+//  Add current run to the archive block
+//  There is always room since a run is only started if it fits
+//
+void ArcRun(Arch* a)
+{
+   if (!a->nrun) return;
+   uint8_t* p = (uint8_t*)(a->b+1)+a->b->len;
+   int16_t  d = a->val-a->prev;
+   p += PutVar(p,(uint16_t)(2*d^(d>>15)));
+   p += PutVar(p,a->nrun);
+   a->b->len  = p-(uint8_t*)(a->b+1);
+   a->prev = a->val;
+   a->nrun = 0;
+}
+
+//
+//  Append archive block and start a new one
+//
+void ArcClose(Arch* a)
+{
+   ArcRun(a);
+   if (pwrite(afd,a->b,ABLK,aoff)!=ABLK) Fatal("Cannot write archive %s\n",afile);
+   aoff += ABLK;
+   memset(a->b,0,ABLK);
+   a->prev = 0;
+}
+
+//
+//  Add column starting at t0 (real ms) to archive block of target
+//  A block is closed when it is full, after ASPAN or at a gap in time
+//
+void ArcAdd(Arch* a,in_addr_t ip,int64_t t0,uint16_t v)
+{
+   Block* b = a->b;
+   int cont = b->n && t0==b->t1 && t0-b->t0<ASPAN;
+   if (!cont || v!=a->val)
+   {
+      ArcRun(a);
+      //  Room for the longest run (3+5 bytes)
+      if (b->n && (!cont || b->len+8>ABLK-sizeof(Block))) ArcClose(a);
+      if (!b->n)
       {
-         if (l%10==0)
-            addch('0');
-         else if (l>10 && (l-1)%10==0)
-            addch('0'+(l%100)/10);
-         else if (l>100 && (l-2)%10==0)
-            addch('0'+l/100);
-         else
-            addch(' ');
+         b->t0  = t0;
+         b->ip  = ip;
+         b->col = col;
       }
-   //  Ping history header left to right
-   else
-      for (int l=0;l<n;l++)
+      a->val = v;
+   }
+   a->nrun++;
+   b->n++;
+   b->t1 = t0+col;
+}
+
+//
+//  Archive writer
+//  Appends the worst ping of each display column of every target once
+//  the pings of the column are settled, so the send and receive threads
+//  never wait for the disk
+//
+void* Archive(void* arg)
+{
+   uint32_t ta=0;  //  Start of next column to archive
+   int      n=0;   //  Columns started
+   int      go=1;
+   while (go)
+   {
+      //  Archive the columns before stopping
+      go = run;
+      //  First column
+      if (!n)
       {
-         if (l%10==0)
-            addch('0');
-         else if (l>8 && (l+1)%10==0)
-            addch('0'+((l+1)%100)/10);
-         else if (l>97 && (l+2)%10==0)
-            addch('0'+(l+2)/100);
-         else
-            addch(' ');
+         uint32_t s;
+         do
+         {
+            s  = SeqRead(&csq);
+            ta = ctim;
+            n  = total;
+         } while (SeqRetry(&csq,s));
+      }
+      //  Columns older than the timeout
+      int64_t  now = (nsnow()+epoch)/1000000;
+      uint32_t tn  = now;
+      while (n && (int32_t)(tn-ta-col)>=2*tmo)
+      {
+         for (int k=0;k<ntar;k++)
+         {
+            Target*  t = pt+k;
+            uint16_t v;
+            uint32_t s;
+            do
+            {
+               s = SeqRead(&t->sq);
+               PingRow(&t->ping,NULL,t->ivl,ta+col,&v,1);
+            } while (SeqRetry(&t->sq,s));
+            ArcAdd(arc+k,t->ip.s_addr,msfull(ta,now),v);
+         }
+         ta += col;
       }
+      if (go) SleepUntil(nsnow()+100000000LL);
+   }
+   //  Write partial blocks
+   for (int k=0;k<ntar;k++)
+      if (arc[k].b->n) ArcClose(arc+k);
+   return NULL;
 }
 
 //
-//  Display
+//  Parse query time YYYY-MM-DD[-HH:MM[:SS]] (local time) to real ms
 //
-void Display(int new)
+int64_t QueryTime(char* s)
 {
-   int bell = 0;
-   //  Stop advance when reviewing until end of buffer is reached
-   if (new && delt) delt++;
-   if (delt>nsec-nping-3) delt = nsec-nping-3;
-   //  Clear
-   erase();
-#ifdef piGPIO
-   //  Do full refresh
-   if (seq%10==0) clearok(curscr,1);
-#endif
+   char* fmt[] = {"%Y-%m-%d-%H:%M:%S","%Y-%m-%d-%H:%M","%Y-%m-%d"};
+   for (int i=0;i<3;i++)
+   {
+      struct tm tm;
+      memset(&tm,0,sizeof(tm));
+      char* e = strptime(s,fmt[i],&tm);
+      if (e && !*e)
+      {
+         tm.tm_isdst = -1;
+         return 1000LL*mktime(&tm);
+      }
+   }
+   Fatal("Invalid time %s (YYYY-MM-DD-HH:MM:SS)\n",s);
+   return 0;
+}
+
+//
+//  Print archived pings of target ip (all if 0) from t0 to t1 (real ms)
+//  Blocks are appended in order of their end time and span at most
+//  ASPAN plus a column, so a binary search on the block headers finds
+//  the first block and the scan stops soon after t1
+//
+void Query(char* file,int64_t t0,int64_t t1,in_addr_t ip)
+{
+   int fd = open(file,O_RDONLY);
+   if (fd<0) Fatal("Cannot open archive %s\n",file);
+   ARhdr hdr;
+   if (pread(fd,&hdr,sizeof(hdr),0)!=sizeof(hdr) || memcmp(hdr.magic,ARMAGIC,8) || hdr.blk!=ABLK)
+      Fatal("%s is not a cping archive\n",file);
+   fine = hdr.fine;
+   off_t nblk = lseek(fd,0,SEEK_END)/ABLK;
+   //  First block ending after t0
+   off_t lo=1,hi=nblk;
+   while (lo<hi)
+   {
+      off_t  mid = (lo+hi)/2;
+      Block  b;
+      if (pread(fd,&b,sizeof(b),mid*ABLK)!=sizeof(b)) Fatal("Cannot read archive %s\n",file);
+      if (b.t1<=t0)
+         lo = mid+1;
+      else
+         hi = mid;
+   }
+   //  Decode blocks in range
+   uint8_t buf[ABLK];
+   Block*  b = (Block*)buf;
+   for (off_t i=lo;i<nblk;i++)
+   {
+      if (pread(fd,buf,ABLK,i*ABLK)!=ABLK) Fatal("Cannot read archive %s\n",file);
+      //  Later blocks start after t1
+      if (b->t1-ASPAN-b->col>=t1) break;
+      if ((ip && b->ip!=ip) || b->t0>=t1 || b->t1<=t0 || b->len>ABLK-sizeof(Block)) continue;
+      char addr[INET_ADDRSTRLEN];
+      inet_ntop(AF_INET,&b->ip,addr,sizeof(addr));
+      uint8_t* p = (uint8_t*)(b+1);
+      uint8_t* e = p+b->len;
+      uint16_t v = 0;
+      int64_t  t = b->t0;
+      while (p<e)
+      {
+         uint32_t z = GetVar(&p,e);
+         uint32_t n = GetVar(&p,e);
+         v += (int16_t)((z>>1)^-(z&1));
+         //  Skip runs before t0
+         if (t+(int64_t)n*b->col<=t0)
+         {
+            t += (int64_t)n*b->col;
+            continue;
+         }
+         for (uint32_t j=0;j<n && t<t1;j++,t+=b->col)
+         {
+            if (t<t0) continue;
+            time_t     s = t/1000;
+            struct tm* l = localtime(&s);
+            printf("%4d-%.2d-%.2d-%.2d:%.2d:%.2d %s",l->tm_year+1900,l->tm_mon+1,l->tm_mday,l->tm_hour,l->tm_min,l->tm_sec,addr);
+            if (v==NoPing)
+               printf(" -\n");
+            else if (v==LostPing)
+               printf(" lost\n");
+            else if (v==LatePing)
+               printf(" late\n");
+            else
+               printf(" %.1f\n",SampleTime(v));
+         }
+      }
+   }
+   close(fd);
+}
+
+//
+//  Initialize traceroute
+//  The sender of the first worker owns the hops so it does this under the
+//  sequence locks
+//
+void InitTrace(Worker* w)
+{
+   int trc = __atomic_load_n(&trcgen,__ATOMIC_ACQUIRE);
+   SeqWrite(&csq);
+   tseq = 0;
+   nhop = 0;
+   SeqDone(&csq);
+   for (int k=0;k<tTTL;k++)
+   {
+      SeqWrite(&tt[k].sq);
+      InitStat(&tt[k].stat);
+      InitPing(&tt[k].ping);
+      SeqDone(&tt[k].sq);
+   }
+   w->trc = trc;
+}
+
+//
+//  Hash table slot of IP address (Knuth multiplicative)
+//
+static inline int HashSlot(in_addr_t ip)
+{
+   return (uint32_t)(ip*2654435761u) >> (32-hbits);
+}
+
+//
+//  Find target with IP address
+//  Returns -1 if not found
+//
+int HashFind(in_addr_t ip)
+{
+   if (!hash) return -1;
+   int mask = (1<<hbits)-1;
+   for (int k=HashSlot(ip);hash[k].ip;k=(k+1)&mask)
+      if (hash[k].ip==ip) return hash[k].idx;
+   return -1;
+}
+
+//
+//  Add target with IP address to hash table
+//  Returns index of the target already using the address or -1
+//  The table is kept at most half full so probes stay short
+//
+int HashAdd(in_addr_t ip,int idx)
+{
+   //  Grow table
+   if (2*(nhash+1)>(1<<hbits))
+   {
+      Slot* old = hash;
+      int   n   = hash ? 1<<hbits : 0;
+      hbits = hbits ? hbits+1 : 6;
+      hash = (Slot*)calloc(1<<hbits,sizeof(Slot));
+      if (!hash) Fatal("Cannot allocate hash table\n");
+      nhash = 0;
+      for (int k=0;k<n;k++)
+         if (old[k].ip) HashAdd(old[k].ip,old[k].idx);
+      free(old);
+   }
+   //  Find address or empty slot
+   int mask = (1<<hbits)-1;
+   int k = HashSlot(ip);
+   for (;hash[k].ip;k=(k+1)&mask)
+      if (hash[k].ip==ip) return hash[k].idx;
+   hash[k].ip  = ip;
+   hash[k].idx = idx;
+   nhash++;
+   return -1;
+}
+
+//
+//  Read configuration file
+//
+void ReadConfig(char* file[],const int nfile)
+{
+   char line[1024];
+   int maxn=0;
+
+   //  Initialize
+   ntar = 0;
+   nhdr = 0;
+   seq  = 0;
+   nwid = 6;  //  Minimum width
+   awid = 6;  //  Addres width
+   //  Initialize Traceroute array (max number of entries it tTTL)
+   tt = (Trace*)calloc(tTTL,sizeof(Trace));
+   //  Open first file in the list that is readable
+   FILE* f=0;
+   for (int k=0;k<nfile && !f;k++)
+      f = fopen(file[k],"r");
+   //  Cannot open any of the files
+   if (!f)
+   {
+      fprintf(stderr,"Cannot open file %s",file[0]);
+      for (int k=1;k<nfile;k++)
+         fprintf(stderr," or %s",file[k]);
+      Fatal("\n");
+   }
+   //  
+   //  Read first 3 characters to check BOM
+   unsigned char magic[3];
+   if (fread(magic,1,3,f)==3 && magic[0]==0xEF && magic[1]==0xBB && magic[2]==0xBF)
+      fprintf(stderr,"WARNING: UTF-8 file treated as ASCII\n");
+   else
+      rewind(f);
+
+   //  Read line
+   int  indent=0;
+   char* hdr=0;
+   while (fgets(line,sizeof(line),f) != NULL )
+   {
+      char host[256];
+      //  Skip comments
+      if (line[0] == '#') continue;
+      //  Trim trailing whitespace
+      int l=strlen(line)-1;
+      while (l>0 && isspace((int)line[l-1])) l--;
+      line[l] = 0;
+      //  Skip blank lines
+      if (l==0) continue;
+      //  Header line
+      if (line[0] == '>')
+      {
+         //  Reset indent
+         if (l==1 && indent>0)
+            hdr = 0;
+         //  Add header
+         else
+         {
+            nhdr++;
+            hdr = malloc(l+1);
+            memcpy(hdr,line+1,l);
+         }
+         indent = l>1?3:0;
+         continue;
+      }
+      //  Next target
+      if (ntar+1>maxn)
+      {
+         maxn += 32;
+         pt = (Target*)realloc(pt,maxn*sizeof(Target));
+         if (!pt) Fatal("Out of memory allocating ping targets\n");
+      }
+      //  Set header
+      pt[ntar].hdr = hdr;
+      if (hdr) hdr = 0;
+      //  Get hostname/ip and offset to start of display name
+      int i;
+      if (sscanf(line,"%255s %n",host,&i)!=1) Fatal("Error reading address: %s\n",line);
+      //  Optional ping interval in seconds as host@interval
+      pt[ntar].ivl = pint;
+      char* at = strchr(host,'@');
+      if (at)
+      {
+         *at = 0;
+         pt[ntar].ivl = WTICK*(int)(1000*atof(at+1)/WTICK+0.5);
+         if (pt[ntar].ivl<WTICK || pt[ntar].ivl>3600000) Fatal("Invalid ping interval: %s\n",line);
+      }
+      //  Save display name and host name
+      if (l>i)
+      {
+         //  Display name
+         l = l-i+indent;
+         pt[ntar].name = malloc(l+1);
+         for (int j=0;j<indent;j++)
+            pt[ntar].name[j] = ' ';
+         memcpy(pt[ntar].name+indent,line+i,l-indent+1);
+         if (l>nwid) nwid = l;
+         //  Hostname
+         l = strlen(host);
+         pt[ntar].host = malloc(l+1);
+         memcpy(pt[ntar].host,host,l+1);
+         if (l>awid) awid = l;
+      }
+      //  Use host name as display name
+      else
+      {
+         l = strlen(host)+indent;
+         pt[ntar].name = malloc(l+1);
+         for (int j=0;j<indent;j++)
+            pt[ntar].name[j] = ' ';
+         memcpy(pt[ntar].name+indent,host,l+1-indent);
+         if (l>nwid) nwid = l;
+         //  Blank host name
+         pt[ntar].host = malloc(1);
+         pt[ntar].host[0] = 0;
+      }
+      //  Enable beep
+      pt[ntar].silent = 0;
+      //  Initialize pings
+      pt[ntar].dt  = -1;
+      pt[ntar].round = 0;
+      pt[ntar].sq  = 0;
+      InitStat(&pt[ntar].stat);
+      //  Get IP address
+      struct hostent* he = gethostbyname(host);
+      if (!he) Fatal("Cannot resolve host name %s\n",host);
+      memcpy(&pt[ntar].ip.s_addr,he->h_addr_list[0],4);
+      //  Set up sa as an IP socket
+      memset(&pt[ntar].sa,0,sizeof(struct sockaddr));
+      struct sockaddr_in *isa = (struct sockaddr_in*)&pt[ntar].sa;
+      isa->sin_family = AF_INET;
+      isa->sin_addr.s_addr = pt[ntar].ip.s_addr;
+      //  Check for duplicate IP addresses
+      if (HashAdd(pt[ntar].ip.s_addr,ntar)>=0)
+        Fatal("%s has a duplicate IP\n",pt[ntar].name);
+      //  Increment ntar
+      ntar++;
+   }
+   fclose (f);
+   if (!ntar) Fatal("No targets in %s\n",file);
+   //  History is limited by the fastest target
+   hcol = nsec;
+   for (int i=0;i<ntar;i++)
+      if (pt[i].ivl<col && nsec*pt[i].ivl/col<hcol) hcol = nsec*pt[i].ivl/col;
+   //  Write header
+   if (fout)
+   {
+      for (int i=0;i<ntar;i++)
+      {
+         if (pt[i].hdr) fprintf(fout,"#                    %s\n",pt[i].hdr);
+         fprintf(fout,"#%-3d %-15s %s\n",i+1,pt[i].host,pt[i].name);
+      }
+      fprintf(fout,"#\n");
+      fprintf(fout,"#  Date      Time  ");
+      for (int i=0;i<ntar;i++)
+         fprintf(fout," %6d",i+1);
+      fprintf(fout,"\n");
+   }
+}
+
+//
+//  Calculate checksum
+//
+unsigned short checksum(char* data,int len)
+{
+   int sum = 0;
+   unsigned short csum = 0;
+   unsigned short* word = (unsigned short*) data;
+   while (len>1)
+   {
+     sum += *word++;
+     len -= 2;
+   }
+   if (len==1)
+   {
+     *(unsigned char *)(&csum) = *(unsigned char *)word;
+     sum += csum;
+   }
+   sum = (sum >> 16) + (sum & 0xffff);  // add hi 16 to low 16
+   sum += (sum >> 16);                  // add carry
+   csum = ~sum;                         // truncate to 16 bits
+   return csum;
+}
+
+//
+//  Draw single ping
+//
+void DrawPing(uint16_t s)
+{
+   //  Color and digit of log scale samples are the same as one byte
+   uint16_t ch = (fine && s<LatePing) ? ByteTime(SampleTime(s)) : s;
+   //  No ping yet
+   if (ch==NoPing)
+   {
+      attron(COLOR_PAIR(1));
+      addch('-');
+   }
+   //  No reply or late reply
+   else if (ch==LostPing || ch==LatePing)
+   {
+      attron(COLOR_PAIR(5));
+      attron(A_BOLD);
+      addch(ch==LostPing?'X':'+');
+      attroff(A_BOLD);
+   }
+   // Reply
+   else
+   {
+      //  Upper nibble is exponent (color)
+      attron(COLOR_PAIR((ch>>4)+2));
+      //  Numeric
+      if (ich==3)
+      {
+         //  Lower nibble is mantissa (0-9)
+         attron(A_BOLD);
+         addch((ch&0xF)+'0');
+         attroff(A_BOLD);
+      }
+      //  Symbol
+      else if (pch)
+         addch(pch);
+      else if (ich==2)
+         addch('*');
+      else if (ich==1)
+         addch(ACS_BLOCK);
+      else
+         addch(ACS_DIAMOND);
+   }
+}
+
+//
+//  Draw row of pings
+//
+void DrawPingRow(uint16_t val[],int n)
+{
+   if (r2l)
+      for (int l=n-1;l>=0;l--)
+         DrawPing(val[l]);
+   else
+      for (int l=0;l<n;l++)
+         DrawPing(val[l]);
+}
+
+//
+//  Figure out the bottom row
+//
+int Bottom(int top)
+{
+   int i = (ntar+nhdr+1<hgt || hgt>20) ? 2 : 1;
+   for (int k=top;k<ntar;k++)
+   {
+      i += pt[k].hdr ? 2 : 1;
+      if (i==hgt)
+         return k;
+      else if (i>hgt)
+         return k-1;
+   }
+   return ntar-1;
+}
+
+//
+//  Print history header
+//
+void PrintHist(int n)
+{
+   //  Ping history header right to left
+   if (r2l)
+      for (int l=n-1;l>=0;l--)
+      {
+         if (l%10==0)
+            addch('0');
+         else if (l>10 && (l-1)%10==0)
+            addch('0'+(l%100)/10);
+         else if (l>100 && (l-2)%10==0)
+            addch('0'+l/100);
+         else
+            addch(' ');
+      }
+   //  Ping history header left to right
+   else
+      for (int l=0;l<n;l++)
+      {
+         if (l%10==0)
+            addch('0');
+         else if (l>8 && (l+1)%10==0)
+            addch('0'+((l+1)%100)/10);
+         else if (l>97 && (l+2)%10==0)
+            addch('0'+(l+2)/100);
+         else
+            addch(' ');
+      }
+}
+
+//
+//  Draw screen from a consistent view of each target and hop
+//  Returns 1 if the bell should ring
+//
+int Frame()
+{
+   int bell = 0;
+   //  Clear
+   erase();
+#ifdef piGPIO
+   //  Do full refresh
+   if (seq%10==0) clearok(curscr,1);
+#endif
    attron(COLOR_PAIR(1));
    //  Help
    if (mode<0)
    {
-      attron(A_BOLD);
-      printw(" Key   Function\n");
-      attroff(A_BOLD);
-      printw(help);
+      attron(A_BOLD);
+      printw(" Key   Function\n");
+      attroff(A_BOLD);
+      printw(help);
+   }
+   //  Traceroute
+   else if (mode)
+   {
+      //  Read hops
+      int nh = nhop;
+      int nr = wid<nsec ? wid : nsec;
+      View    tv[tTTL];
+      uint16_t tval[tTTL][nr>0 ? nr : 1];
+      for (int k=0;k<nh;k++)
+         ReadTrace(tt+k,tv+k,tval[k],nr,ColEnd(delt));
+      //  Unwind trailing lack of response
+      while (nh>1 && !tv[nh-1].ip && !tv[nh-2].ip)
+         nh--;
+      //  Display
+      if (nh+3<hgt) timeprint();
+      attron(A_BOLD);
+      printw("Traceroute to %s\n\n",pt[sel].name);
+      //  Look up hostname and figure longest name
+      int len=5;
+      int lan=4;
+      for (int k=0;k<nh;k++)
+      {
+         int l = nslookup(tt+k,tv[k].ip);
+         if (l>len) len = l;
+         l = strlen(tt[k].addr);
+         if (l>lan) lan = l;
+      }
+      //  Truncate hostnames if too long
+      if (len+lan+12>wid) len = wid-12-lan;
+      int ntrac = wid-13-len-lan-(tsmode?1:0);
+      if (stat) ntrac -= 41;
+      if (ntrac>nsec) ntrac = nsec;
+      //  Print header
+      printw("Hop Host");
+      for (int k=0;k<len;k++)
+         addch(' ');
+      printw(" IP");
+      for (int k=5;k<lan;k++)
+         addch(' ');
+      PrintHist(ntrac);
+      printw(tsmode ? "    ms " : "    ms");
+      if (stat) printw("   min   avg   p50   p95   p99   max lost");
+      printw("\n");
+      attroff(A_BOLD);
+      int m = (nh<hgt-3) ? nh : hgt-3;
+      //  Print replies
+      for (int k=0;k<m;k++)
+      {
+         attron(COLOR_PAIR(1));
+         printw("%3d ",k+1);
+         char* ch = tt[k].fqdn;
+         for (int l=0;l<len+1;l++)
+            addch(*ch?*ch++:' ');
+         ch = tt[k].addr;
+         for (int l=0;l<lan+1;l++)
+            addch(*ch?*ch++:' ');
+         //  Pings
+         DrawPingRow(tval[k],ntrac);
+         //  Draw stats
+         attron(COLOR_PAIR(1));
+         if (tv[k].dt<0)
+            printw(" unrch");
+         else
+            printw(" %5.1f",tv[k].dt);
+         if (tsmode) addch(tv[k].dt>0 ? tsrc[tv[k].src] : ' ');
+         if (stat) printw("%6.1f%6.1f%6.1f%6.1f%6.1f%6.1f%5d",tv[k].stat.min,tv[k].stat.avg,Quantile(&tv[k].stat,0.5),Quantile(&tv[k].stat,0.95),Quantile(&tv[k].stat,0.99),tv[k].stat.max,tv[k].stat.lost);
+         printw("\n");
+      }
+      //  Bell on lost packets
+      if (!silent && !pt[sel].silent)
+         for (int k=0;k<nh;k++)
+            bell = bell | (tv[k].dt<0);
+   }
+   //  Ping
+   else
+   {
+      int i=1;
+      //  Print header if we have enough rows
+      if (ntar+nhdr+1<hgt || hgt>20)
+      {
+         timeprint();
+         i++;
+      }
+      //
+      //  Print header line
+      //
+      attron(A_BOLD);
+      //  Display name
+      printw("Target");
+      for (int l=6;l<nwid;l++)
+         addch(' ');
+      //  Host/IP if selected
+      if (showip)
+      {
+         printw(" Address");
+         for (int l=7;l<awid;l++)
+            addch(' ');
+      }
+      PrintHist(nping);
+      //  Ping times
+      printw(tsmode ? "   ms " : "   ms");
+      //  Number of hops
+      if (hop) printw(" hop");
+      //  Stats since reset or in the last minutes
+      if (stat && wsel)
+         printw("%4dm   avg   std loss%% replies lost late",wlen[wsel-1]);
+      else if (stat)
+         printw("   min   avg   p50   p95   p99   max lost");
+      attroff(A_BOLD);
+      //
+      //  Draw ping table
+      //
+      for (int k=top;k<ntar;k++)
+      {
+         //  Bail out at the bottom of the screen
+         if (i>=hgt) break;
+         //  Target name
+         move(i++,0);
+         if (pt[k].hdr)
+         {
+            attron(A_BOLD);
+            printw(pt[k].hdr);
+            attroff(A_BOLD);
+            move(i++,0);
+            //  Bail out at the bottom of the screen
+            if (i>hgt) break;
+         }
+         //  Choose color
+         if (k==sel && pt[k].silent)
+            attron(COLOR_PAIR(4));
+         else if (pt[k].silent)
+            attron(COLOR_PAIR(5));
+         else if (k==sel)
+            attron(COLOR_PAIR(3));
+         else
+            attron(COLOR_PAIR(1));
+         //  Print name
+         char* ch = pt[k].name;
+         for (int l=0;l<nwid;l++)
+            addch(*ch?*ch++:'.');
+         //  Print address
+         if (showip)
+         {
+            addch(' ');
+            char* ch = pt[k].host;
+            for (int l=0;l<awid;l++)
+               addch(*ch?*ch++:'.');
+         }
+         if (k==sel) attron(COLOR_PAIR(1));
+         //  Pings
+         View    v;
+         uint16_t val[nping];
+         ReadTarget(pt+k,&v,val,nping,ColEnd(delt));
+         DrawPingRow(val,nping);
+         //  Ping time
+         attron(COLOR_PAIR(1));
+         if (v.dt<0)
+            printw(" -----");
+         else
+            printw(" %5.1f",v.dt);
+         if (tsmode) addch(v.dt<0 ? ' ' : tsrc[v.src]);
+         //  Hop count
+         if (hop)
+         {
+            //  Guess initial TTL as 256, 128 or 64
+            int TTL0;
+            if (v.ttl>128)
+               TTL0 = 256;
+            else if (v.ttl>64)
+               TTL0 = 128;
+            else
+               TTL0 = 64;
+            //  Print hops
+            int l = TTL0+1-v.ttl;
+            if (v.dt<0 || l<0)
+               printw(" --");
+            else
+               printw(" %2d",l);
+         }
+         //  Draw stats
+         if (stat && wsel)
+         {
+            Win* w = &v.win;
+            printw("     %6.1f%6.1f%6.1f%8u%5u%5u",w->n?w->mean:-1,w->n>1?sqrt(w->m2/(w->n-1)):0,
+                   w->n+w->lost?100.0*w->lost/(w->n+w->lost):0,w->n,w->lost,w->late);
+         }
+         else if (stat)
+            printw("%6.1f%6.1f%6.1f%6.1f%6.1f%6.1f%5d",v.stat.min,v.stat.avg,Quantile(&v.stat,0.5),Quantile(&v.stat,0.95),Quantile(&v.stat,0.99),v.stat.max,v.stat.lost);
+      }
+      //  Bell on lost packets in the newest columns even when scrolled back
+      if (!silent)
+         for (int k=0;k<ntar;k++)
+         {
+            //  Use the previous column while the current ping is in flight
+            View    tv;
+            uint16_t v[2];
+            ReadTarget(pt+k,&tv,v,2,ColEnd(0));
+            if (v[0]==NoPing) v[0] = v[1];
+            bell = bell | (seq>1 && v[0]==LostPing && !pt[k].silent);
+         }
+   }
+   return bell;
+}
+
+//
+//  Display
+//
+void Display(int new)
+{
+   //  Stop advance when reviewing until end of buffer is reached
+   if (new && delt) delt++;
+   //  Rollups go back further than the history
+   int back = (int64_t)NHOUR*3600000/col;
+   if (back<hcol) back = hcol;
+   if (delt>back-nping-3) delt = back-nping-3;
+   if (delt<0) delt = 0;
+   //  Draw again if a column started meanwhile so all rows are from one round
+   int bell = 0;
+   for (int i=0;i<3;i++)
+   {
+      uint32_t c = SeqRead(&csq);
+      bell = Frame();
+      if (!SeqRetry(&csq,c)) break;
+   }
+   show = 0;
+   if (new && bell) beep();
+   refresh();
+}
+
+//
+//  Build ICMP echo request template
+//     idx - target index
+//     hop - traceroute hop (0 for pings)
+//
+void InitEcho(Echo* pkt,int id,int idx,int hop)
+{
+   memset(pkt,0,sizeof(Echo));
+   pkt->hdr.type       = ICMP_ECHO;
+   pkt->hdr.code       = 0;
+   pkt->hdr.un.echo.id = id;
+   pkt->hdr.un.echo.sequence = hop;
+   pkt->pay.magic = MAGIC;
+   pkt->pay.ver   = PAYVER;
+   pkt->pay.hop   = hop;
+   pkt->pay.idx   = idx;
+   pkt->hdr.checksum = checksum((char*)pkt,sizeof(Echo));
+}
+
+//
+//  Replace n words and update the checksum incrementally (RFC 1624)
+//     HC' = ~(~HC + ~m + m')
+//  Words are copied so packet fields of any type may be passed
+//
+static inline void Cksum(uint16_t* sum,void* word,const void* val,int n)
+{
+   uint32_t s = (uint16_t)~*sum;
+   for (int i=0;i<n;i++)
+   {
+      uint16_t w,v;
+      memcpy(&w,(char*)word+2*i,2);
+      memcpy(&v,(const char*)val+2*i,2);
+      s += (uint16_t)~w;
+      s += v;
+   }
+   memcpy(word,val,2*n);
+   s = (s>>16) + (s&0xffff);
+   s += (s>>16);
+   *sum = ~s;
+}
+
+//
+//  Set sequence number, round and time in ICMP echo request template
+//
+static inline void SetEcho(Echo* pkt,uint32_t round,int seq)
+{
+   uint16_t sq = seq;
+   Cksum(&pkt->hdr.checksum,&pkt->hdr.un.echo.sequence,&sq,1);
+   Cksum(&pkt->hdr.checksum,&pkt->pay.round,&round,sizeof(round)/2);
+   int64_t time = nsnow();
+   Cksum(&pkt->hdr.checksum,&pkt->pay.t0,&time,sizeof(time)/2);
+}
+
+//
+//  Send ICMP packet
+//  The socket TTL is pTTL so other TTL values are set per packet
+//  Where that is not possible the socket TTL is cached in sttl
+//
+void ICMP(int s,int* sttl,Echo* pkt,int ttl,struct sockaddr* sa)
+{
+   struct iovec iov = {pkt,PKTLEN};
+   struct msghdr msg;
+   memset(&msg,0,sizeof(msg));
+   msg.msg_name    = sa;
+   msg.msg_namelen = sizeof(struct sockaddr);
+   msg.msg_iov     = &iov;
+   msg.msg_iovlen  = 1;
+#ifdef __linux__
+   //  Linux accepts the TTL as ancillary data
+   char cbuf[CMSG_SPACE(sizeof(int))];
+   if (ttl!=pTTL)
+   {
+      memset(cbuf,0,sizeof(cbuf));
+      msg.msg_control    = cbuf;
+      msg.msg_controllen = sizeof(cbuf);
+      struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = IPPROTO_IP;
+      cmsg->cmsg_type  = IP_TTL;
+      cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+      memcpy(CMSG_DATA(cmsg),&ttl,sizeof(int));
+   }
+#else
+   //  Elsewhere set the socket TTL only when it changes
+   if (ttl!=*sttl)
+   {
+      if (setsockopt(s,IPPROTO_IP,IP_TTL,(void*)&ttl,sizeof(ttl))<0) Fatal("Cannot set TTL\n");
+      *sttl = ttl;
+   }
+#endif
+   //  Send packet
+   int i = sendmsg(s,&msg,0);
+#ifdef __APPLE__
+   //  Some OSX machines inexplicably return -1
+   if (i>0 && i!=PKTLEN) fprintf(stderr,"Failed to send ICMP packet\n");
+#else
+   if (i<0 || i!=PKTLEN) fprintf(stderr,"Failed to send ICMP packet\n");
+#endif
+}
+
+//
+//  Initialize packet templates and batch of ping messages
+//  The addresses never change so only the templates are updated each round
+//
+void InitBatch()
+{
+   for (int k=0;k<ntar;k++)
+      InitEcho(&pt[k].echo,worker[pt[k].wk].id,k,0);
+   for (int k=0;k<tTTL;k++)
+      InitEcho(&tt[k].echo,traceid,0,k+1);
+#ifdef __linux__
+   mmsg = (struct mmsghdr*)calloc(ntar,sizeof(struct mmsghdr));
+   miov = (struct iovec*)calloc(ntar,sizeof(struct iovec));
+   if (!mmsg || !miov) Fatal("Cannot allocate message buffers\n");
+   for (int w=0;w<nwk;w++)
+   {
+      worker[w].mbat = (struct mmsghdr*)calloc(nbat,sizeof(struct mmsghdr));
+      if (!worker[w].mbat) Fatal("Cannot allocate message buffers\n");
+   }
+   for (int k=0;k<ntar;k++)
+   {
+      miov[k].iov_base = &pt[k].echo;
+      miov[k].iov_len  = PKTLEN;
+      mmsg[k].msg_hdr.msg_name    = &pt[k].sa;
+      mmsg[k].msg_hdr.msg_namelen = sizeof(struct sockaddr);
+      mmsg[k].msg_hdr.msg_iov     = miov+k;
+      mmsg[k].msg_hdr.msg_iovlen  = 1;
+   }
+#endif
+}
+
+#ifdef URING
+//
+//  io_uring submission and completion rings
+//
+typedef struct
+{
+   int                  fd;     // Ring descriptor
+   unsigned*            sqhead; // Submission queue head
+   unsigned*            sqtail; // Submission queue tail
+   unsigned             sqmask; // Submission queue mask
+   unsigned*            sqarr;  // Submission queue index array
+   struct io_uring_sqe* sqe;    // Submission queue entries
+   unsigned*            cqhead; // Completion queue head
+   unsigned*            cqtail; // Completion queue tail
+   unsigned             cqmask; // Completion queue mask
+   struct io_uring_cqe* cqe;    // Completion queue entries
+   unsigned             nsub;   // Entries not yet submitted
+} Uring;
+Uring srng;                     //  Send ring (send thread)
+Uring rrng;                     //  Receive ring (receive thread)
+struct io_uring_buf_ring* bring;//  Provided receive buffer ring
+unsigned char* bmem;            //  Provided receive buffers
+uint16_t btail;                 //  Provided buffer ring tail
+struct msghdr  rtmpl;           //  Receive message template
+uint64_t       rtag[2];         //  Receive request for ping and trace socket
+int            rfd[2];          //  Socket of each receive request
+int            rgen;            //  Socket generation of receive requests
+
+//
+//  Set up ring with room for n submissions
+//  Returns -1 if io_uring is not available
+//
+int UringSetup(Uring* r,unsigned n,unsigned ncq)
+{
+   struct io_uring_params p;
+   memset(&p,0,sizeof(p));
+   if (ncq)
+   {
+      p.flags      = IORING_SETUP_CQSIZE;
+      p.cq_entries = ncq;
+   }
+   r->fd = syscall(__NR_io_uring_setup,n,&p);
+   if (r->fd<0) return -1;
+   //  Map rings and submission entries
+   size_t sqlen = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+   size_t cqlen = p.cq_off.cqes  + p.cq_entries*sizeof(struct io_uring_cqe);
+   if (p.features & IORING_FEAT_SINGLE_MMAP && cqlen>sqlen) sqlen = cqlen;
+   unsigned char* sq = mmap(0,sqlen,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,r->fd,IORING_OFF_SQ_RING);
+   unsigned char* cq = (p.features & IORING_FEAT_SINGLE_MMAP) ? sq :
+                       mmap(0,cqlen,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,r->fd,IORING_OFF_CQ_RING);
+   r->sqe = mmap(0,p.sq_entries*sizeof(struct io_uring_sqe),PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,r->fd,IORING_OFF_SQES);
+   if (sq==MAP_FAILED || cq==MAP_FAILED || r->sqe==MAP_FAILED || !(p.features & IORING_FEAT_CQE_SKIP))
+   {
+      close(r->fd);
+      r->fd = -1;
+      return -1;
+   }
+   r->sqhead = (unsigned*)(sq+p.sq_off.head);
+   r->sqtail = (unsigned*)(sq+p.sq_off.tail);
+   r->sqmask = *(unsigned*)(sq+p.sq_off.ring_mask);
+   r->sqarr  = (unsigned*)(sq+p.sq_off.array);
+   r->cqhead = (unsigned*)(cq+p.cq_off.head);
+   r->cqtail = (unsigned*)(cq+p.cq_off.tail);
+   r->cqmask = *(unsigned*)(cq+p.cq_off.ring_mask);
+   r->cqe    = (struct io_uring_cqe*)(cq+p.cq_off.cqes);
+   r->nsub   = 0;
+   return 0;
+}
+
+//
+//  Submit queued entries and optionally wait for a completion
+//
+void UringSubmit(Uring* r,int wait)
+{
+   if (!r->nsub && !wait) return;
+   int k = syscall(__NR_io_uring_enter,r->fd,r->nsub,wait,wait ? IORING_ENTER_GETEVENTS : 0,NULL,0);
+   if (k>0) r->nsub -= k;
+}
+
+//
+//  Get next submission entry
+//  Submits queued entries when the queue is full
+//
+struct io_uring_sqe* UringSqe(Uring* r)
+{
+   unsigned tail = *r->sqtail;
+   while (tail-__atomic_load_n(r->sqhead,__ATOMIC_ACQUIRE)>r->sqmask)
+      UringSubmit(r,0);
+   struct io_uring_sqe* sqe = r->sqe + (tail&r->sqmask);
+   memset(sqe,0,sizeof(*sqe));
+   r->sqarr[tail&r->sqmask] = tail&r->sqmask;
+   __atomic_store_n(r->sqtail,tail+1,__ATOMIC_RELEASE);
+   r->nsub++;
+   return sqe;
+}
+
+//
+//  Next completion or NULL
+//
+struct io_uring_cqe* UringCqe(Uring* r)
+{
+   unsigned head = *r->cqhead;
+   if (head==__atomic_load_n(r->cqtail,__ATOMIC_ACQUIRE)) return NULL;
+   return r->cqe + (head&r->cqmask);
+}
+
+//
+//  Release completion
+//
+static inline void UringSeen(Uring* r)
+{
+   __atomic_store_n(r->cqhead,*r->cqhead+1,__ATOMIC_RELEASE);
+}
+
+//
+//  Send pings to n targets in list on the worker socket with one
+//  io_uring_enter call
+//  Only failed sends produce completions
+//
+void UringSend(Worker* w,int* list,int n)
+{
+   for (int i=0;i<n;i++)
+   {
+      struct io_uring_sqe* sqe = UringSqe(&srng);
+      sqe->opcode    = IORING_OP_SENDMSG;
+      sqe->fd        = w->sock;
+      sqe->addr      = (uintptr_t)&mmsg[list[i]].msg_hdr;
+      sqe->len       = 1;
+      sqe->flags     = IOSQE_CQE_SKIP_SUCCESS;
+      sqe->user_data = list[i];
+   }
+   UringSubmit(&srng,0);
+   for (struct io_uring_cqe* cqe;(cqe=UringCqe(&srng));UringSeen(&srng))
+      if (cqe->res<0) fprintf(stderr,"Failed to send ICMP packet\n");
+}
+#endif
+
+//
+//  Send ping to n targets in list on the worker socket with the socket TTL pTTL
+//  Packets are stamped just before sending so the timestamps are current
+//
+void ICMPbatch(Worker* w,int* list,int n)
+{
+   for (int i=0;i<n;i++)
+      SetEcho(&pt[list[i]].echo,pt[list[i]].round,pt[list[i]].round&0xFFFF);
+#ifdef URING
+   if (xport)
+   {
+      UringSend(w,list,n);
+      return;
+   }
+#endif
+#ifdef __linux__
+   //  Send batch with as few system calls as possible
+   for (int i=0;i<n;i++)
+      w->mbat[i] = mmsg[list[i]];
+   for (int i=0;i<n;)
+   {
+      int k = sendmmsg(w->sock,w->mbat+i,n-i,0);
+      //  Skip packet that failed
+      if (k<=0)
+      {
+         fprintf(stderr,"Failed to send ICMP packet\n");
+         k = 1;
+      }
+      i += k;
+   }
+#else
+   for (int i=0;i<n;i++)
+      ICMP(w->sock,&w->ttl,&pt[list[i]].echo,pTTL,&pt[list[i]].sa);
+#endif
+}
+
+//
+//  Shift ping buffer
+//  Lost pings are added to the rollups when they time out
+//
+void PingShift(Ping* ping,Stat* stat,Roll* roll)
+{
+   uint32_t t = mstime(nsnow());
+   //  Lost<0 means initialize
+   if (stat->lost<0)
+   {
+      stat->lost = 0;
+      ping->pend = 0;
+   }
+   //  Pings that can no longer be answered in time are lost
+   //  Limit lost to 99999 to prevent field overflow
+   while (ping->pend>0 && t-GetTime(ping,ping->pend-1)>=tmo)
+   {
+      ping->pend--;
+      if (GetPing(ping,ping->pend)!=LostPing) continue;
+      if (stat->lost<99999) stat->lost++;
+      if (roll) Rollup(roll,GetTime(ping,ping->pend),1,0);
+   }
+   //  Minutes leave the windows even without replies
+   if (roll) WinMove(roll,(nsnow()+epoch)/60000000000LL);
+   //  Shift ping buffer
+   //  The index is stored once so readers never see it out of range
+   int cur = ping->cur-1;
+   if (cur<0) cur += nsec;
+   ping->cur = cur;
+   //  Initialize as lost
+   SetPing(ping,0,LostPing);
+   ping->tim[ping->cur] = t;
+   if (ping->pend<nsec) ping->pend++;
+}
+
+//
+//  Request display update
+//
+void Refresh()
+{
+   show = 1;
+#ifdef __linux__
+   if (efd>=0)
+   {
+      uint64_t one = 1;
+      ssize_t  n = write(efd,&one,sizeof(one));
+      (void)n;
+   }
+#endif
+}
+
+void Drain(Worker* w);
+void Reset(Worker* w);
+void SockClose(Worker* w);
+#ifdef __linux__
+void RecvReady(int fd,int revents);
+
+//
+//  Descriptors to poll for received packets of worker
+//  With io_uring packets arrive on the ring and the sockets are only
+//  polled for the error queue
+//
+int RecvFds(Worker* w,struct pollfd pfd[])
+{
+   int n=0;
+   short ev = xport ? 0 : POLLIN;
+   pfd[n].fd     = w->sock;
+   pfd[n].events = ev;
+   pfd[n++].revents = 0;
+   //  First worker also receives traceroutes
+   if (w==worker && tsock!=sock)
+   {
+      pfd[n].fd     = tsock;
+      pfd[n].events = ev;
+      pfd[n++].revents = 0;
+   }
+   //  Ring is last so send times on the error queue are read first
+#ifdef URING
+   if (xport)
+   {
+      pfd[n].fd     = rrng.fd;
+      pfd[n].events = POLLIN;
+      pfd[n++].revents = 0;
+   }
+#endif
+   return n;
+}
+#endif
+#ifdef __linux__
+//
+//  Receive packets for ns nanoseconds
+//  Checks once for packets that are waiting when ns is 0
+//
+void RecvPoll(int64_t ns)
+{
+   int64_t end = nsnow()+ns;
+   int64_t dt  = ns;
+   do
+   {
+      struct pollfd pfd[3];
+      int n = RecvFds(worker,pfd);
+      struct timespec ts = {dt/1000000000,dt%1000000000};
+      if (ppoll(pfd,n,&ts,NULL)>0)
+         for (int i=0;i<n;i++)
+            RecvReady(pfd[i].fd,pfd[i].revents);
+      dt = end-nsnow();
+   } while (dt>0);
+}
+#endif
+
+//
+//  Pause between batches of pings
+//  The event loop keeps receiving replies while it waits
+//
+void Pause(int us)
+{
+#ifdef __linux__
+   if (evmode)
+   {
+      RecvPoll(1000LL*us);
+      return;
+   }
+#endif
+   usleep(us);
+}
+
+//
+//  Add target to the timing wheel of its worker
+//
+void WheelAdd(int k)
+{
+   Worker* w = worker+pt[k].wk;
+   int i = pt[k].due % NWHEEL;
+   pt[k].next = w->wheel[i];
+   w->wheel[i] = k;
+}
+
+//
+//  Initialize timing wheel
+//  The phase of each target is fixed so it is pinged at a steady interval
+//     burst  - all targets at the start of the interval
+//     spread - targets with the same interval evenly spaced
+//     jitter - pseudo-random phase derived from the IP address
+//
+void InitWheel()
+{
+   for (int w=0;w<nwk;w++)
+   {
+      worker[w].plist = (int*)malloc(ntar*sizeof(int));
+      worker[w].rq    = (Result*)malloc(NQUEUE*sizeof(Result));
+      if (!worker[w].plist || !worker[w].rq) Fatal("Cannot allocate ping list\n");
+      for (int i=0;i<NWHEEL;i++)
+         worker[w].wheel[i] = -1;
+      worker[w].tk = 0;
+   }
+   for (int k=0;k<ntar;k++)
+      pt[k].due = -1;
+   for (int k=0;k<ntar;k++)
+   {
+      int iv = pt[k].ivl/WTICK;
+      //  Spread evenly over targets with the same interval
+      if (pace==1 && pt[k].due<0)
+      {
+         int n=0;
+         for (int i=k;i<ntar;i++)
+            if (pt[i].ivl==pt[k].ivl) n++;
+         for (int i=k,j=0;i<ntar;i++)
+            if (pt[i].ivl==pt[k].ivl) pt[i].due = (int64_t)iv*j++/n;
+      }
+      //  Hash of IP address (Knuth multiplicative)
+      //  The high bits of the hash are scaled to the interval
+      //  since the low bits depend only on the low address bits
+      else if (pace==2)
+         pt[k].due = (uint64_t)(uint32_t)(ntohl(pt[k].ip.s_addr)*2654435761u)*iv>>32;
+      //  Burst
+      else if (pace==0)
+         pt[k].due = 0;
+      WheelAdd(k);
+   }
+}
+
+//
+//  Next wheel tick after tk with any targets
+//
+int64_t WheelNext(Worker* w,int64_t tk)
+{
+   for (int i=1;i<NWHEEL;i++)
+      if (w->wheel[(tk+i)%NWHEEL]>=0) return tk+i;
+   return tk+NWHEEL;
+}
+
+//
+//  Ping targets due at wheel tick tk
+//  Targets that missed ticks before tn get a single ping
+//
+void WheelTick(Worker* w,int64_t tk,int64_t tn)
+{
+   //  Remove targets that are due from the slot
+   int n=0;
+   int* plist = w->plist;
+   int* p = w->wheel+tk%NWHEEL;
+   while (*p>=0)
+   {
+      int k = *p;
+      if (pt[k].due<=tk)
+      {
+         *p = pt[k].next;
+         plist[n++] = k;
+      }
+      else
+         p = &pt[k].next;
+   }
+   //  Ping in batches
+   for (int i=0;i<n;i+=nbat)
+   {
+      int m = (i+nbat<n) ? nbat : n-i;
+      //  Advance ping array and round
+      for (int j=i;j<i+m;j++)
+      {
+         Target* t = pt+plist[j];
+         SeqWrite(&t->sq);
+         PingShift(&t->ping,&t->stat,t->roll);
+         t->round++;
+         Save(t);
+         SeqDone(&t->sq);
+      }
+      // Send batch of pings
+      ICMPbatch(w,plist+i,m);
+      //  Pause before sending next batch
+      if (pus) Pause(pus);
+   }
+   //  Schedule next ping
+   for (int i=0;i<n;i++)
+   {
+      int k  = plist[i];
+      int iv = pt[k].ivl/WTICK;
+      pt[k].due += iv;
+      if (pt[k].due<=tn) pt[k].due += ((tn-pt[k].due)/iv+1)*iv;
+      WheelAdd(k);
+   }
+}
+
+//
+//  Start display column
+//
+void Column(int64_t t)
+{
+   SeqWrite(&csq);
+   total++;
+   ctim = mstime(t);
+   //  Parallel traceroute
+   tseq++;
+   nhop = tTTL;
+   SeqDone(&csq);
+   for (int k=0;k<tTTL;k++)
+   {
+      //  Initialize trace
+      SeqWrite(&tt[k].sq);
+      tt[k].dt = 0;
+      tt[k].ip = 0;
+      tt[k].tx.sw = tt[k].tx.hw = 0;
+      PingShift(&tt[k].ping,&tt[k].stat,NULL);
+      SeqDone(&tt[k].sq);
+      //  Send Ping
+      SetEcho(&tt[k].echo,tseq,k+1);
+      ICMP(tsock,tttl,&tt[k].echo,k+1,&pt[sel].sa);
+      //  Pause before sending next
+      if (pus) Pause(pus);
+   }
+   //  Write ping times
+   if (fout && seq)
+   {
+      time_t t =  time(NULL);
+      struct tm*  l = localtime(&t);
+      fprintf(fout,"%4d-%.2d-%.2d-%.2d:%.2d:%.2d",l->tm_year+1900,l->tm_mon+1,l->tm_mday,l->tm_hour,l->tm_min,l->tm_sec);
+      for (int i=0;i<ntar;i++)
+      {
+         View v;
+         ReadTarget(pt+i,&v,NULL,0,0);
+         fprintf(fout," %6.1f",v.dt);
+      }
+      fprintf(fout,"\n");
+   }
+   seq++;
+}
+
+//
+//  Send pings of worker that are due
+//  The first worker also starts columns and updates the display
+//  Columns, display updates and pings are scheduled on absolute
+//  deadlines from a single origin so the period does not drift
+//  Returns the time of the next event (monotonic ns)
+//
+int64_t SendTick(Worker* w)
+{
+   static int64_t tc  = 0;             //  Next column
+   static int64_t ts  = -1;            //  Next display update
+   int64_t per = col*1000000LL;        //  Column period (ns)
+   int64_t tic = WTICK*1000000LL;      //  Wheel tick (ns)
+   while (1)
+   {
+      int64_t t = nsnow()-origin;
+      //  Apply replies before the ping arrays move on
+      Drain(w);
+      //  Reset once the receiver has closed the sockets of the last one
+      if (w->rst!=__atomic_load_n(&rstgen,__ATOMIC_ACQUIRE) && __atomic_load_n(&w->ogen,__ATOMIC_ACQUIRE)==w->gen)
+         Reset(w);
+      //  Restart traceroute to a newly selected target
+      if (w==worker && w->trc!=__atomic_load_n(&trcgen,__ATOMIC_ACQUIRE))
+         InitTrace(w);
+      //  Replies are applied at least every tick
+      int64_t cap = evmode ? INT64_MAX : (t/tic+1)*tic;
+      //  Ping targets that are due
+      if (w!=worker)
+      {
+         for (int64_t tn=t/tic;w->tk<=tn;w->tk++)
+            WheelTick(w,w->tk,tn);
+         int64_t next = WheelNext(w,w->tk-1)*tic;
+         return origin+(cap<next ? cap : next);
+      }
+      //  Start a new column
+      if (t>=tc)
+      {
+         Column(origin+tc);
+         //  Update display 950ms after the start of the column
+         ts  = tc+950000000LL;
+         tc += per;
+      }
+      //  Ping targets that are due
+      for (int64_t tn=t/tic;w->tk<=tn;w->tk++)
+         WheelTick(w,w->tk,tn);
+      //  Update display
+      if (ts>=0 && t>=ts)
+      {
+         Refresh();
+         ts = -1;
+         //  Check if this is a finite ping
+         if (num>0 && seq>=num) run = 0;
+      }
+      //  Next event
+      int64_t next = WheelNext(w,w->tk-1)*tic;
+      if (tc<next) next = tc;
+      if (ts>=0 && ts<next) next = ts;
+      if (cap<next) next = cap;
+      //  Overrun skips to the next column boundary
+      int64_t dt = nsnow()-origin-tc;
+      if (next==tc && dt>0)
+      {
+         int skip = dt/per+1;
+         tc += skip*per;
+         novr++;
+         if (fout)
+         {
+            time_t t =  time(NULL);
+            struct tm*  l = localtime(&t);
+            fprintf(fout,"#OVERRUN %4d-%.2d-%.2d-%.2d:%.2d:%.2d %.1f ms late, %d round(s) skipped\n",
+               l->tm_year+1900,l->tm_mon+1,l->tm_mday,l->tm_hour,l->tm_min,l->tm_sec,dt*1e-6,skip);
+         }
+         continue;
+      }
+      return origin+next;
+   }
+}
+
+//
+//  Pin thread to a core when there are several workers
+//
+void Pin(Worker* w)
+{
+#ifdef __linux__
+   if (nwk<2) return;
+   cpu_set_t set;
+   CPU_ZERO(&set);
+   CPU_SET((w-worker)%sysconf(_SC_NPROCESSORS_ONLN),&set);
+   pthread_setaffinity_np(pthread_self(),sizeof(set),&set);
+#endif
+}
+
+//
+//  Send pings thread
+//
+void* SendPing(void* arg)
+{
+   Worker* w = (Worker*)arg;
+   Pin(w);
+   while (run)
+      SleepUntil(SendTick(w));
+   return NULL;
+}
+
+//
+//  Unpack ICMP header
+//
+int UnpackICMP(unsigned char* data,int l,int* rtp,int* rcd,int* rid,int* rsq)
+{
+   if (l<sizeof(struct icmphdr)) return 0;
+   struct icmphdr* icp = (struct icmphdr*)data;
+   *rtp = icp->type;
+   *rcd = icp->code;
+   *rid = icp->un.echo.id;
+   *rsq = icp->un.echo.sequence;
+   return sizeof(struct icmphdr);
+}
+
+//
+//  Unpack IP/ICMP header
+//
+int UnpackHeader(unsigned char* data,int l,int* ttl,int* rtp,int* rcd, int* rid,int* rsq)
+{
+   //  Get TTL
+   if (l<sizeof(struct ip)) return 0;
+   struct ip* ip = (struct ip*)data;
+   *ttl = ip->ip_ttl;
+   //  Skip the IP header
+   int hlen = ip->ip_hl << 2;
+   if (l<hlen) return 0;
+   //  Unpack ICMP header
+   int len = UnpackICMP(data+hlen,l-hlen,rtp,rcd,rid,rsq);
+   return len ? hlen+len : 0;
+}
+
+//
+//  Update ping stats
+//
+void Stats(double dt,int src,Stat* stat)
+{
+   stat->n++;
+   stat->nsrc[src]++;
+   stat->S  += dt;
+   stat->S2 += dt*dt;
+   if (stat->min<0 || dt<stat->min) stat->min = dt;
+   if (stat->max<0 || dt>stat->max) stat->max = dt;
+   stat->avg = stat->S / stat->n;
+   stat->std = (stat->n > 1) ? sqrt((stat->S2-stat->S*stat->S/stat->n)/(stat->n-1)) : 0;
+   //  Histogram bucket from the log scale sample
+   int b = LogTime(dt)/(SPO/QPO);
+   stat->q[b<NQB?b:NQB-1]++;
+}
+
+//
+//  Round trip time (ms) from the best timestamps available
+//     t0    - user send time from the payload (monotonic)
+//     tx    - kernel send time
+//     round - round of the reply
+//     rx    - kernel receive time (software and hardware)
+//     src   - set to index in tsrc
+//
+double RTT(int64_t t0,Stamp* tx,uint32_t round,int64_t rx[],int* src)
+{
+   //  Both times from the same clock
+   if (rx[1] && tx->hw && tx->round==round)
+   {
+      *src = 3;
+      return 1e-6*(rx[1]-tx->hw);
+   }
+   else if (rx[0] && tx->sw && tx->round==round)
+   {
+      *src = 2;
+      return 1e-6*(rx[0]-tx->sw);
+   }
+   //  Kernel receive time is real time so convert to monotonic
+   else if (rx[0])
+   {
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME,&ts);
+      int64_t off = ts.tv_sec*1000000000LL + ts.tv_nsec - nsnow();
+      *src = 1;
+      return 1e-6*(rx[0]-off-t0);
+   }
+   //  User time
+   *src = 0;
+   return 1e-6*(nsnow()-t0);
+}
+
+//
+//  Copy payload returned with a message
+//  Returns 1 if the payload is complete and 0 if only the time is present
+//
+int GetPayload(unsigned char* data,int l,Payload* pay)
+{
+   memset(pay,0,sizeof(Payload));
+   memcpy(pay,data,l<sizeof(Payload) ? l : sizeof(Payload));
+   return l>=sizeof(Payload) && pay->magic==MAGIC && pay->ver==PAYVER;
+}
+
+//
+//  Apply reply to the target or trace state
+//  Only the thread sending the pings (the owner) changes the state
+//
+void Apply(Result* r)
+{
+   //  Ping reply
+   if (r->type==0)
+   {
+      Target* t = pt+r->idx;
+      SeqWrite(&t->sq);
+      //  Offset in ping array
+      int k = (int32_t)(t->round-r->round);
+      //  Current
+      if (0<=k && k<t->ping.pend)
+      {
+         t->ttl = r->ttl;
+         t->dt  = r->dt;
+         t->src = r->src;
+         SetPing(&t->ping,k,Sample(r->dt));
+         Stats(r->dt,r->src,&t->stat);
+         Rollup(t->roll,GetTime(&t->ping,k),0,r->dt);
+      }
+      //  Late
+      else
+      {
+         t->stat.late++;
+         //  Check offset in range and previously marked as lost
+         if (0<k && k<nsec && GetPing(&t->ping,k)==LostPing)
+         {
+            SetPing(&t->ping,k,LatePing);
+            Rollup(t->roll,GetTime(&t->ping,k),2,0);
+         }
+      }
+      Save(t);
+      SeqDone(&t->sq);
+   }
+   //  Traceroute reply or time exceeded from this round
+   else if (r->type<3 && r->idx<=nhop && r->round==tseq)
+   {
+      Trace* t = tt+r->idx-1;
+      //  Length of path
+      if (r->type==1) nhop = r->idx;
+      SeqWrite(&t->sq);
+      t->dt  = r->dt;
+      t->src = r->src;
+      t->ip  = r->ip;
+      SetPing(&t->ping,0,Sample(r->dt));
+      Stats(r->dt,r->src,&t->stat);
+      SeqDone(&t->sq);
+   }
+   //  Destination unreachable
+   else if (r->type==3 && r->idx<nhop)
+   {
+      Trace* t = tt+r->idx-1;
+      nhop = r->idx;
+      SeqWrite(&t->sq);
+      t->dt = -1;
+      t->ip = r->ip;
+      SeqDone(&t->sq);
+   }
+}
+
+//
+//  Apply replies queued by the receiver of worker
+//
+void Drain(Worker* w)
+{
+   uint32_t t = w->qtail;
+   uint32_t h = __atomic_load_n(&w->qhead,__ATOMIC_ACQUIRE);
+   while (t!=h)
+      Apply(w->rq+t++%NQUEUE);
+   __atomic_store_n(&w->qtail,t,__ATOMIC_RELEASE);
+}
+
+//
+//  Pass reply to the owner of the state
+//  The receiver never waits so replies are dropped if the queue is full
+//  In the event loop the receiver is the owner so it is applied directly
+//
+void Post(Worker* w,Result* r)
+{
+   if (evmode)
+   {
+      Apply(r);
+      return;
+   }
+   uint32_t h = w->qhead;
+   if (h-__atomic_load_n(&w->qtail,__ATOMIC_ACQUIRE)>=NQUEUE)
+   {
+      w->qdrop++;
+      return;
+   }
+   w->rq[h%NQUEUE] = *r;
+   __atomic_store_n(&w->qhead,h+1,__ATOMIC_RELEASE);
+}
+
+//
+//  Worker of the receive thread (the first for the event loop)
+//
+static __thread Worker* self = worker;
+
+//
+//  Process ICMP message
+//     from    - source of the message
+//     rtp     - ICMP type
+//     ttl     - TTL of echo reply
+//     rid,rsq - ID and sequence of our echo request
+//     data    - payload of our echo request
+//     rx      - kernel receive time (0 if not available)
+//  The time is taken here and the result is queued for the sender
+//
+void Reply(in_addr_t from,int rtp,int ttl,int rid,int rsq,unsigned char* data,int l,int64_t rx[])
+{
+   Payload pay;
+   int full = GetPayload(data,l,&pay);
+   Result r;
+   r.ttl = ttl;
+   r.ip  = from;
+   //  Traceroute round (the rest of the payload may be missing)
+   uint32_t round = full ? pay.round : __atomic_load_n(&tseq,__ATOMIC_RELAXED);
+   //  Process echo reply
+   if (rtp==ICMP_ECHOREPLY && l>=sizeof(int64_t))
+   {
+      //  Target is in the payload unless the reply truncated it
+      int host = (full && pay.idx<ntar) ? pay.idx : HashFind(from);
+      //  Ping reply from known host of this worker
+      if (host>=0 && worker+pt[host].wk==self && rid==self->id && pay.hop==0 && from==pt[host].ip.s_addr)
+      {
+         //  Round from the 16 bit sequence number
+         if (!full)
+         {
+            uint32_t cur = __atomic_load_n(&pt[host].round,__ATOMIC_RELAXED);
+            pay.round = cur - (uint16_t)(cur-rsq);
+         }
+         r.type  = 0;
+         r.idx   = host;
+         r.round = pay.round;
+         r.dt    = RTT(pay.t0,&pt[host].tx,pay.round,rx,&r.src);
+         Post(self,&r);
+      }
+      //  Traceroute reply
+      else if (rid==traceid && rsq>0 && rsq<=tTTL && self==worker)
+      {
+         r.type  = 1;
+         r.idx   = rsq;
+         r.round = round;
+         r.dt    = RTT(pay.t0,&tt[rsq-1].tx,round,rx,&r.src);
+         Post(self,&r);
+      }
+   }
+   //  Traceroute time exceeded
+   else if (rtp==ICMP_TIME_EXCEEDED && l>=sizeof(int64_t))
+   {
+      if (rid==traceid && rsq>0 && rsq<=tTTL && self==worker)
+      {
+         r.type  = 2;
+         r.idx   = rsq;
+         r.round = round;
+         r.dt    = RTT(pay.t0,&tt[rsq-1].tx,round,rx,&r.src);
+         Post(self,&r);
+      }
+   }
+   //  Destination unreachable
+   else if (rtp==ICMP_UNREACH)
+   {
+      if (rid==traceid && rsq>0 && rsq<tTTL && self==worker)
+      {
+         r.type = 3;
+         r.idx  = rsq;
+         Post(self,&r);
+      }
+   }
+}
+
+//
+//  Get TTL and kernel receive time from ancillary data
+//
+void Ancillary(struct msghdr* msg,int* ttl,int64_t rx[])
+{
+   rx[0] = rx[1] = 0;
+   for (struct cmsghdr* cmsg=CMSG_FIRSTHDR(msg);cmsg;cmsg=CMSG_NXTHDR(msg,cmsg))
+   {
+      if (cmsg->cmsg_level==IPPROTO_IP && cmsg->cmsg_type==IP_TTL)
+         memcpy(ttl,CMSG_DATA(cmsg),sizeof(int));
+#ifdef __linux__
+      //  Software time is first and hardware time third
+      else if (cmsg->cmsg_level==SOL_SOCKET && cmsg->cmsg_type==SO_TIMESTAMPING)
+      {
+         struct timespec ts[3];
+         memcpy(ts,CMSG_DATA(cmsg),sizeof(ts));
+         rx[0] = ts[0].tv_sec*1000000000LL + ts[0].tv_nsec;
+         rx[1] = ts[2].tv_sec*1000000000LL + ts[2].tv_nsec;
+      }
+#endif
+   }
+}
+
+//
+//  Process packet from raw socket
+//  Packets start with the IP header and errors contain our original packet
+//
+void ProcRaw(unsigned char* data,int l,struct sockaddr_in* from,struct msghdr* msg)
+{
+   //  Unpack header
+   int ttl,rtp,rcd,rid,rsq;
+   int off = UnpackHeader(data,l,&ttl,&rtp,&rcd,&rid,&rsq);
+   if (!off) return;
+   data += off;
+   l    -= off;
+   //  Data of errors is original packet
+   if (rtp==ICMP_TIME_EXCEEDED || rtp==ICMP_UNREACH)
+   {
+      int ttl0,rtp0;
+      off = UnpackHeader(data,l,&ttl0,&rtp0,&rcd,&rid,&rsq);
+      if (!off) return;
+      data += off;
+      l    -= off;
+   }
+   //  Kernel receive time (TTL is from the IP header)
+   int64_t rx[2];
+   int ttl1;
+   Ancillary(msg,&ttl1,rx);
+   Reply(from->sin_addr.s_addr,rtp,ttl,rid,rsq,data,l,rx);
+}
+
+#ifndef __linux__
+//
+//  Receive packet from raw socket
+//
+void RecvRaw(int s)
+{
+   unsigned char buf[8192];
+   char cbuf[256];
+   //  Check for reply
+   struct sockaddr_in from;
+   struct iovec iov = {buf,sizeof(buf)};
+   struct msghdr msg;
+   memset(&msg,0,sizeof(msg));
+   msg.msg_name       = &from;
+   msg.msg_namelen    = sizeof(from);
+   msg.msg_iov        = &iov;
+   msg.msg_iovlen     = 1;
+   msg.msg_control    = cbuf;
+   msg.msg_controllen = sizeof(cbuf);
+   int l = recvmsg(s,&msg,0);
+   if (l>=0) ProcRaw(buf,l,&from,&msg);
+}
+#endif
+
+#ifdef __linux__
+//
+//  Attach filter to raw socket so the kernel drops other ICMP traffic
+//  Accepts echo replies with the worker ID (and the traceroute ID on the
+//  first worker) and time exceeded or unreachable messages carrying them
+//  in the original packet.  Our packets have no IP options so the
+//  original ICMP header is 20 bytes into the data.
+//
+void SetFilter(int s,int id,int trace)
+{
+   struct sock_filter code[] =
+   {
+      BPF_STMT(BPF_LDX|BPF_B|BPF_MSH,0),                          //  X = IP header length
+      BPF_STMT(BPF_LD|BPF_B|BPF_IND,0),                           //  A = ICMP type
+      BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K,ICMP_ECHOREPLY,0,2),
+      BPF_STMT(BPF_LD|BPF_H|BPF_IND,4),                           //  A = ID of echo reply
+      BPF_JUMP(BPF_JMP|BPF_JA,3,0,0),
+      BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K,ICMP_TIME_EXCEEDED,1,0),
+      BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K,ICMP_UNREACH,0,3),
+      BPF_STMT(BPF_LD|BPF_H|BPF_IND,sizeof(struct icmphdr)+20+4), //  A = ID of original packet
+      BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K,htons(id),2,0),
+      BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K,htons(trace ? traceid : id),1,0),
+      BPF_STMT(BPF_RET|BPF_K,0),                                  //  Drop
+      BPF_STMT(BPF_RET|BPF_K,0xFFFF),                             //  Accept
+   };
+   struct sock_fprog prog = {sizeof(code)/sizeof(code[0]),code};
+   //  Not fatal since the receiver checks the IDs anyway
+   if (setsockopt(s,SOL_SOCKET,SO_ATTACH_FILTER,&prog,sizeof(prog))<0)
+      fprintf(stderr,"Cannot attach ICMP filter\n");
+}
+
+//
+//  Enable kernel send and receive times on socket
+//
+void SetStamp(int s)
+{
+   int flags = SOF_TIMESTAMPING_SOFTWARE|SOF_TIMESTAMPING_RX_SOFTWARE|SOF_TIMESTAMPING_TX_SOFTWARE;
+   if (tsmode==2) flags |= SOF_TIMESTAMPING_RAW_HARDWARE|SOF_TIMESTAMPING_RX_HARDWARE|SOF_TIMESTAMPING_TX_HARDWARE;
+   if (setsockopt(s,SOL_SOCKET,SO_TIMESTAMPING,&flags,sizeof(flags))<0) Fatal("Cannot enable kernel timestamps\n");
+}
+
+//
+//  Report kernel drops with received packets
+//
+void SetDrop(int s)
+{
+   int on=1;
+   if (setsockopt(s,SOL_SOCKET,SO_RXQ_OVFL,&on,sizeof(on))<0) Fatal("Cannot set SO_RXQ_OVFL\n");
+}
+
+//
+//  Open unprivileged ping socket
+//  The kernel sets the ICMP ID to the port and only delivers matching replies
+//  Returns -1 if ping sockets are not permitted
+//
+int PingSock(int* id)
+{
+   int s = socket(AF_INET,SOCK_DGRAM,IPPROTO_ICMP);
+   if (s<0) return -1;
+   //  Port is the ID in network order so bytes in the packet match
+   struct sockaddr_in isa;
+   memset(&isa,0,sizeof(isa));
+   isa.sin_family = AF_INET;
+   isa.sin_port   = *id;
+   //  Let the kernel pick the ID if ours is taken
+   socklen_t len = sizeof(isa);
+   if (bind(s,(struct sockaddr*)&isa,sizeof(isa))<0)
+   {
+      isa.sin_port = 0;
+      if (bind(s,(struct sockaddr*)&isa,sizeof(isa))<0 || getsockname(s,(struct sockaddr*)&isa,&len)<0) Fatal("Cannot bind ping socket\n");
+      *id = isa.sin_port;
+   }
+   //  Receive TTL with replies and ICMP errors on the error queue
+   int on=1;
+   if (setsockopt(s,IPPROTO_IP,IP_RECVTTL,&on,sizeof(on))<0) Fatal("Cannot set IP_RECVTTL\n");
+   if (setsockopt(s,IPPROTO_IP,IP_RECVERR,&on,sizeof(on))<0) Fatal("Cannot set IP_RECVERR\n");
+   return s;
+}
+
+//
+//  Receive packet from ping socket
+//  Packets start with the ICMP header and the TTL is ancillary data
+//
+void ProcDgram(unsigned char* buf,int l,struct sockaddr_in* from,struct msghdr* msg)
+{
+   //  Get TTL and kernel receive time
+   int ttl=0;
+   int64_t rx[2];
+   Ancillary(msg,&ttl,rx);
+   //  Unpack header
+   int rtp,rcd,rid,rsq;
+   int off = UnpackICMP(buf,l,&rtp,&rcd,&rid,&rsq);
+   if (off) Reply(from->sin_addr.s_addr,rtp,ttl,rid,rsq,buf+off,l-off,rx);
+}
+
+//
+//  Update count of packets dropped by the kernel because the socket was full
+//  Raw sockets report it with each packet (SO_RXQ_OVFL) but ping sockets
+//  do not so they are asked for it
+//
+void Dropped(int s,struct msghdr* msg)
+{
+   uint32_t* drop = &tdrop;
+   for (int w=0;w<nwk;w++)
+      if (s==worker[w].sock) drop = &worker[w].drop;
+   for (struct cmsghdr* cmsg=CMSG_FIRSTHDR(msg);cmsg;cmsg=CMSG_NXTHDR(msg,cmsg))
+      if (cmsg->cmsg_level==SOL_SOCKET && cmsg->cmsg_type==SO_RXQ_OVFL)
+      {
+         uint32_t n;
+         memcpy(&n,CMSG_DATA(cmsg),sizeof(n));
+         if (n>*drop) *drop = n;
+      }
+   if (dgram)
+   {
+      uint32_t mem[SK_MEMINFO_VARS];
+      socklen_t len = sizeof(mem);
+      if (getsockopt(s,SOL_SOCKET,SO_MEMINFO,mem,&len)==0 && len>SK_MEMINFO_DROPS*sizeof(uint32_t))
+         *drop = mem[SK_MEMINFO_DROPS];
+   }
+}
+
+//
+//  Receive batch of packets with one system call
+//  Blocks until a packet arrives unless flags is MSG_DONTWAIT
+//
+void RecvBatch(int s,int flags)
+{
+   //  Buffers are per thread since each worker receives on its own
+   static __thread struct
+   {
+      unsigned char      buf[NRECV][RBUF];
+      char               cbuf[NRECV][256];
+      struct sockaddr_in from[NRECV];
+      struct iovec       iov[NRECV];
+      struct mmsghdr     msg[NRECV];
+   }* rb = NULL;
+   if (!rb && !(rb=malloc(sizeof(*rb)))) Fatal("Cannot allocate receive buffers\n");
+   unsigned char      (*buf)[RBUF] = rb->buf;
+   char               (*cbuf)[256] = rb->cbuf;
+   struct sockaddr_in* from = rb->from;
+   struct iovec*       iov  = rb->iov;
+   struct mmsghdr*     msg  = rb->msg;
+   //  Lengths are changed by each call
+   memset(msg,0,sizeof(rb->msg));
+   for (int i=0;i<NRECV;i++)
+   {
+      iov[i].iov_base = buf[i];
+      iov[i].iov_len  = RBUF;
+      msg[i].msg_hdr.msg_name       = from+i;
+      msg[i].msg_hdr.msg_namelen    = sizeof(from[i]);
+      msg[i].msg_hdr.msg_iov        = iov+i;
+      msg[i].msg_hdr.msg_iovlen     = 1;
+      msg[i].msg_hdr.msg_control    = cbuf[i];
+      msg[i].msg_hdr.msg_controllen = sizeof(rb->cbuf[i]);
+   }
+   int n = recvmmsg(s,msg,NRECV,flags,NULL);
+   if (n<=0) return;
+   for (int i=0;i<n;i++)
+   {
+      if (dgram)
+         ProcDgram(buf[i],msg[i].msg_len,from+i,&msg[i].msg_hdr);
+      else
+         ProcRaw(buf[i],msg[i].msg_len,from+i,&msg[i].msg_hdr);
+   }
+   //  The last packet has the latest drop count
+   Dropped(s,&msg[n-1].msg_hdr);
+}
+
+#ifdef URING
+//
+//  Return buffer to the provided buffer ring
+//
+static inline void UringBuf(int bid)
+{
+   struct io_uring_buf* buf = &bring->bufs[btail&(NUBUF-1)];
+   buf->addr = (uintptr_t)(bmem+bid*RBUF);
+   buf->len  = RBUF;
+   buf->bid  = bid;
+   btail++;
+   __atomic_store_n(&bring->tail,btail,__ATOMIC_RELEASE);
+}
+
+//
+//  Start multishot receive on socket i (0=ping 1=trace)
+//  The kernel picks a provided buffer for each packet
+//
+void UringArm(int i,int fd)
+{
+   static uint64_t gen=0;
+   rfd[i]  = fd;
+   rtag[i] = (++gen<<1)|i;
+   struct io_uring_sqe* sqe = UringSqe(&rrng);
+   sqe->opcode    = IORING_OP_RECVMSG;
+   sqe->fd        = fd;
+   sqe->addr      = (uintptr_t)&rtmpl;
+   sqe->len       = 1;
+   sqe->ioprio    = IORING_RECV_MULTISHOT;
+   sqe->flags     = IOSQE_BUFFER_SELECT;
+   sqe->buf_group = 0;
+   sqe->user_data = rtag[i];
+}
+
+//
+//  Cancel receive request i
+//
+void UringCancel(int i)
+{
+   struct io_uring_sqe* sqe = UringSqe(&rrng);
+   sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+   sqe->addr      = rtag[i];
+   sqe->user_data = 0;
+   rtag[i] = 0;
+}
+
+//
+//  Make sure the current sockets have a receive request
+//  Sockets are replaced by a reset and multishot requests end when the
+//  buffers run out
+//
+void UringCheck()
+{
+   //  The generation is read first since the sender replaces the sockets
+   //  before it moves the generation on
+   int gen = __atomic_load_n(&sgen,__ATOMIC_ACQUIRE);
+   int fd[2] = {sock,tsock==sock ? -1 : tsock};
+   for (int i=0;i<2;i++)
+   {
+      if (rtag[i] && rgen!=gen) UringCancel(i);
+      if (!rtag[i] && fd[i]>=0) UringArm(i,fd[i]);
    }
-   //  Traceroute
-   else if (mode)
+   rgen = gen;
+   UringSubmit(&rrng,0);
+}
+
+//
+//  Process received packets from the receive ring
+//
+void UringRecv()
+{
+   int n=0;
+   for (struct io_uring_cqe* cqe;(cqe=UringCqe(&rrng));UringSeen(&rrng))
    {
-      //  Unwind trailing lack of response
-      while (nhop>1 && !tt[nhop-1].ip && !tt[nhop-2].ip)
-         nhop--;
-      //  Display
-      if (nhop+3<hgt) timeprint();
-      attron(A_BOLD);
-      printw("Traceroute to %s\n\n",pt[sel].name);
-      //  Look up hostname and figure longest name
-      int len=5;
-      int lan=4;
-      for (int k=0;k<nhop;k++)
+      //  Packet in a provided buffer
+      if (cqe->flags & IORING_CQE_F_BUFFER)
       {
-         int l = nslookup(tt+k);
-         if (l>len) len = l;
-         l = strlen(tt[k].addr);
-         if (l>lan) lan = l;
+         int bid = cqe->flags>>IORING_CQE_BUFFER_SHIFT;
+         unsigned char* buf = bmem+bid*RBUF;
+         int i = cqe->user_data&1;
+         if (cqe->res>0 && cqe->user_data==rtag[i])
+         {
+            //  Name, control data and packet follow the header
+            struct io_uring_recvmsg_out* out = (struct io_uring_recvmsg_out*)buf;
+            unsigned char* name = buf+sizeof(*out);
+            unsigned char* data = name+rtmpl.msg_namelen+rtmpl.msg_controllen;
+            int l = out->payloadlen;
+            if (l>cqe->res-(data-buf)) l = cqe->res-(data-buf);
+            struct msghdr msg;
+            memset(&msg,0,sizeof(msg));
+            msg.msg_control    = name+rtmpl.msg_namelen;
+            msg.msg_controllen = out->controllen;
+            if (dgram)
+               ProcDgram(data,l,(struct sockaddr_in*)name,&msg);
+            else
+            {
+               ProcRaw(data,l,(struct sockaddr_in*)name,&msg);
+               Dropped(rfd[i],&msg);
+            }
+            n++;
+         }
+         UringBuf(bid);
       }
-      //  Truncate hostnames if too long
-      if (len+lan+12>wid) len = wid-12-lan;
-      int ntrac = wid-13-len-lan;
-      if (stat) ntrac -= 23;
-      if (ntrac>nsec) ntrac = nsec;
-      //  Print header
-      printw("Hop Host");
-      for (int k=0;k<len;k++)
-         addch(' ');
-      printw(" IP");
-      for (int k=5;k<lan;k++)
-         addch(' ');
-      PrintHist(ntrac);
-      printw("    ms");
-      if (stat) printw("   min   avg   max lost");
-      printw("\n");
-      attroff(A_BOLD);
-      int m = (nhop<hgt-3) ? nhop : hgt-3;
-      //  Print replies
-      for (int k=0;k<m;k++)
+      //  Request ended (out of buffers or cancelled)
+      if (!(cqe->flags & IORING_CQE_F_MORE) && cqe->user_data && cqe->user_data==rtag[cqe->user_data&1])
+         rtag[cqe->user_data&1] = 0;
+   }
+   //  Ping sockets are asked for drops
+   if (dgram && n)
+   {
+      struct msghdr msg;
+      memset(&msg,0,sizeof(msg));
+      Dropped(sock,&msg);
+      Dropped(tsock,&msg);
+   }
+   UringCheck();
+}
+
+//
+//  Set up io_uring transport
+//  Falls back to system calls if io_uring or multishot receive is missing
+//
+void InitUring()
+{
+   //  Send ring holds a batch and receive ring holds the requests
+   unsigned n = 8;
+   while (n<nbat && n<4096) n *= 2;
+   rrng.fd = -1;
+   if (UringSetup(&srng,n,0)) goto fail;
+   if (UringSetup(&rrng,8,4*NUBUF)) goto fail;
+   //  Provided buffers
+   bring = mmap(0,NUBUF*sizeof(struct io_uring_buf),PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+   bmem  = (unsigned char*)malloc(NUBUF*RBUF);
+   if (bring==MAP_FAILED || !bmem) Fatal("Cannot allocate io_uring buffers\n");
+   struct io_uring_buf_reg reg;
+   memset(&reg,0,sizeof(reg));
+   reg.ring_addr    = (uintptr_t)bring;
+   reg.ring_entries = NUBUF;
+   reg.bgid         = 0;
+   if (syscall(__NR_io_uring_register,rrng.fd,IORING_REGISTER_PBUF_RING,&reg,1)<0) goto fail;
+   btail = 0;
+   for (int i=0;i<NUBUF;i++)
+      UringBuf(i);
+   //  Receive template sets the space for the address and control data
+   memset(&rtmpl,0,sizeof(rtmpl));
+   rtmpl.msg_namelen    = sizeof(struct sockaddr_in);
+   rtmpl.msg_controllen = RCTL;
+   //  Start receive and check that multishot receive is accepted
+   rtag[0] = rtag[1] = 0;
+   UringCheck();
+   struct io_uring_cqe* cqe = UringCqe(&rrng);
+   if (cqe && cqe->res<0 && !(cqe->flags & IORING_CQE_F_MORE)) goto fail;
+   return;
+fail:
+   if (srng.fd>=0) close(srng.fd);
+   if (rrng.fd>=0) close(rrng.fd);
+   xport   = 0;
+   nouring = 1;
+}
+#endif
+
+//
+//  Record kernel send time of our packet returned on the error queue
+//  The packet includes the link layer header so look for the IP header
+//
+void TxStamp(unsigned char* buf,int l,int64_t ts[])
+{
+   for (int i=0;i<64 && i+sizeof(struct ip)<=l;i++)
+   {
+      struct ip* ip = (struct ip*)(buf+i);
+      int ttl,rtp,rcd,rid,rsq;
+      if (ip->ip_v!=4 || ip->ip_p!=IPPROTO_ICMP) continue;
+      int off = UnpackHeader(buf+i,l-i,&ttl,&rtp,&rcd,&rid,&rsq);
+      if (!off || rtp!=ICMP_ECHO) continue;
+      //  Target and hop are in the payload
+      Payload pay;
+      if (!GetPayload(buf+i+off,l-i-off,&pay)) return;
+      Stamp* tx = NULL;
+      if (pay.hop==0 && pay.idx<ntar && rid==worker[pt[pay.idx].wk].id)
+         tx = &pt[pay.idx].tx;
+      else if (rid==traceid && pay.hop>0 && pay.hop<=tTTL)
+         tx = &tt[pay.hop-1].tx;
+      if (tx)
       {
-         attron(COLOR_PAIR(1));
-         printw("%3d ",k+1);
-         char* ch = tt[k].fqdn;
-         for (int l=0;l<len+1;l++)
-            addch(*ch?*ch++:' ');
-         ch = tt[k].addr;
-         for (int l=0;l<lan+1;l++)
-            addch(*ch?*ch++:' ');
-         //  Pings
-         DrawPingRow(&tt[k].ping,ntrac);
-         //  Draw stats
-         attron(COLOR_PAIR(1));
-         if (tt[k].dt<0)
-            printw(" unrch");
-         else
-            printw(" %5.1f",tt[k].dt);
-         if (stat) printw("%6.1f%6.1f%6.1f%5d",tt[k].stat.min,tt[k].stat.avg,tt[k].stat.max,tt[k].stat.lost);
-         printw("\n");
+         tx->round = pay.round;
+         tx->sw  = ts[0];
+         tx->hw  = ts[1];
       }
-      //  Bell on lost packets
-      if (!silent && !pt[sel].silent)
-         for (int k=0;k<nhop;k++)
-            bell = bell | (tt[k].dt<0);
+      return;
    }
-   //  Ping
-   else
+}
+
+//
+//  Receive message from socket error queue
+//  ICMP errors contain our original packet and the sender is the offender
+//  Send times contain our packet as sent
+//
+void RecvError(int s)
+{
+   unsigned char buf[512];
+   char cbuf[512];
+   struct sockaddr_in to;
+   struct iovec iov = {buf,sizeof(buf)};
+   struct msghdr msg;
+   memset(&msg,0,sizeof(msg));
+   msg.msg_name       = &to;
+   msg.msg_namelen    = sizeof(to);
+   msg.msg_iov        = &iov;
+   msg.msg_iovlen     = 1;
+   msg.msg_control    = cbuf;
+   msg.msg_controllen = sizeof(cbuf);
+   int l = recvmsg(s,&msg,MSG_ERRQUEUE|MSG_DONTWAIT);
+   if (l<0) return;
+   //  Kernel time of message
+   int ttl=0;
+   int64_t ts[2];
+   Ancillary(&msg,&ttl,ts);
+   for (struct cmsghdr* cmsg=CMSG_FIRSTHDR(&msg);cmsg;cmsg=CMSG_NXTHDR(&msg,cmsg))
+      if (cmsg->cmsg_level==IPPROTO_IP && cmsg->cmsg_type==IP_RECVERR)
+      {
+         struct sock_extended_err* ee = (struct sock_extended_err*)CMSG_DATA(cmsg);
+         //  Send time
+         if (ee->ee_origin==SO_EE_ORIGIN_TIMESTAMPING)
+            TxStamp(buf,l,ts);
+         //  ICMP error
+         else if (ee->ee_origin==SO_EE_ORIGIN_ICMP)
+         {
+            struct sockaddr_in* isa = (struct sockaddr_in*)SO_EE_OFFENDER(ee);
+            int rtp,rcd,rid,rsq;
+            int off = UnpackICMP(buf,l,&rtp,&rcd,&rid,&rsq);
+            if (off) Reply(isa->sin_addr.s_addr,ee->ee_type,0,rid,rsq,buf+off,l-off,ts);
+         }
+      }
+}
+#endif
+
+//
+//  Set socket receive buffer size
+//  SO_RCVBUFFORCE may exceed net.core.rmem_max when privileged
+//
+void SetRcvbuf(int s)
+{
+#ifdef SO_RCVBUFFORCE
+   if (setsockopt(s,SOL_SOCKET,SO_RCVBUFFORCE,&rcvbuf,sizeof(rcvbuf))==0) return;
+#endif
+   if (setsockopt(s,SOL_SOCKET,SO_RCVBUF,&rcvbuf,sizeof(rcvbuf))<0) Fatal("Cannot set receive buffer size\n");
+}
+
+#ifdef __linux__
+//
+//  Receive from socket that is ready
+//  Errors and send times are on the error queue
+//
+void RecvReady(int fd,int revents)
+{
+#ifdef URING
+   if (xport && fd==rrng.fd)
    {
-      int i=1;
-      //  Print header if we have enough rows
-      if (ntar+nhdr+1<hgt || hgt>20)
+      UringRecv();
+      return;
+   }
+#endif
+   if (revents & POLLERR) RecvError(fd);
+   if (revents & POLLIN)  RecvBatch(fd,MSG_DONTWAIT);
+}
+#endif
+
+//
+//  Receive pings for worker
+//
+void* Receive(void* arg)
+{
+   Worker* w = (Worker*)arg;
+   self = w;
+   Pin(w);
+   while (1)
+   {
+      //  Sockets replaced by a reset
+      SockClose(w);
+#ifdef __linux__
+      //  Ping and traceroute sockets with replies, errors and send times
+      //  A reset does not wake up poll so check every 100ms
+      if (dgram || tsmode || xport)
       {
-         timeprint();
-         i++;
+         struct pollfd pfd[3];
+         int n = RecvFds(w,pfd);
+#ifdef URING
+         if (xport) UringCheck();
+#endif
+         if (poll(pfd,n,100)<=0) continue;
+         for (int i=0;i<n;i++)
+            RecvReady(pfd[i].fd,pfd[i].revents);
       }
-      //
-      //  Print header line
-      //
-      attron(A_BOLD);
-      //  Display name
-      printw("Target");
-      for (int l=6;l<nwid;l++)
-         addch(' ');
-      //  Host/IP if selected
-      if (showip)
+      //  Raw socket
+      else
+         RecvBatch(w->sock,MSG_WAITFORONE);
+#else
+      RecvRaw(w->sock);
+#endif
+   }
+}
+
+
+//
+//  Check that selected item is in range
+//  dir=0 is resizing the screen
+//
+void Scroll(int dir)
+{
+   //  Everything fits
+   if (ntar+nhdr+1<hgt)
+      top = 0;
+   //  Ping mode scroll or resize
+   else if (!mode)
+   {
+      //  Current bottom
+      int bot = Bottom(top);
+      // Scroll down
+      if (dir>0)
       {
-         printw(" Address");
-         for (int l=7;l<awid;l++)
-            addch(' ');
+         for (int i=0;i<dir && Bottom(top)<ntar-1;i++)
+            bot = Bottom(++top);
       }
-      PrintHist(nping);
-      //  Ping times
-      printw("   ms");
-      //  Number of hops
-      if (hop) printw(" hop");
-      //  Stats
-      if (stat) printw("   min   avg   max lost");
-      attroff(A_BOLD);
-      //
-      //  Draw ping table
-      //
-      for (int k=top;k<ntar;k++)
+      //  Scroll up
+      else if (dir<0)
       {
-         //  Bail out at the bottom of the screen
-         if (i>=hgt) break;
-         //  Target name
-         move(i++,0);
-         if (pt[k].hdr)
-         {
-            attron(A_BOLD);
-            printw(pt[k].hdr);
-            attroff(A_BOLD);
-            move(i++,0);
-            //  Bail out at the bottom of the screen
-            if (i>hgt) break;
-         }
-         //  Choose color
-         if (k==sel && pt[k].silent)
-            attron(COLOR_PAIR(4));
-         else if (pt[k].silent)
-            attron(COLOR_PAIR(5));
-         else if (k==sel)
-            attron(COLOR_PAIR(3));
-         else
-            attron(COLOR_PAIR(1));
-         //  Print name
-         char* ch = pt[k].name;
-         for (int l=0;l<nwid;l++)
-            addch(*ch?*ch++:'.');
-         //  Print address
-         if (showip)
-         {
-            addch(' ');
-            char* ch = pt[k].host;
-            for (int l=0;l<awid;l++)
-               addch(*ch?*ch++:'.');
-         }
-         if (k==sel) attron(COLOR_PAIR(1));
-         //  Pings
-         DrawPingRow(&pt[k].ping,nping);
-         //  Ping time
-         attron(COLOR_PAIR(1));
-         if (pt[k].dt<0)
-            printw(" -----");
-         else
-            printw(" %5.1f",pt[k].dt);
-         //  Hop count
-         if (hop)
-         {
-            //  Guess initial TTL as 256, 128 or 64
-            int TTL0;
-            if (pt[k].ttl>128)
-               TTL0 = 256;
-            else if (pt[k].ttl>64)
-               TTL0 = 128;
-            else
-               TTL0 = 64;
-            //  Print hops
-            int l = TTL0+1-pt[k].ttl;
-            if (pt[k].dt<0 || l<0)
-               printw(" --");
-            else
-               printw(" %2d",l);
-         }
-         //  Draw stats
-         if (stat) printw("%6.1f%6.1f%6.1f%5d",pt[k].stat.min,pt[k].stat.avg,pt[k].stat.max,pt[k].stat.lost);
+         top = top+dir>0 ? top+dir : 0;
+         bot = Bottom(top);
       }
-      //  Bell on lost packets
-      if (!silent)
-         for (int k=0;k<ntar;k++)
-            bell = bell | (seq>1 && GetPing(&pt[k].ping,0)==LostPing && !pt[k].silent);
+      //  Check that selection is on the screen
+      if (sel<top) sel = top;
+      if (sel>bot) sel = bot;
+   }
+   //  Resize in traceroute mode
+   else if (!dir)
+   {
+      //  Current bottom
+      int bot = Bottom(top);
+      //  Make sure that selection remains on the screen
+      if (sel<top) top = sel;
+      if (sel>bot) top -= sel-bot;
+      if (top<0) top = 0;
+   }
+}
+
+//
+//  Select new target
+//
+void newsel(int dir)
+{
+   int new = sel+dir;
+   if (new<0)
+      new = 0;
+   else if (new>=ntar)
+      new = ntar-1;
+   //  Scroll up if required
+   if (dir<0)
+   {
+      while (new<top)
+        Scroll(-1);
    }
-   show = 0;
-   if (new && bell) beep();
-   refresh();
+   //  Scroll down if required
+   else
+   {
+      while (new>Bottom(top))
+        Scroll(+1);
+   }
+   sel = new;
+   //  Reset traceroute hops when selected target changes
+   //  The sender owns the hops so it does the reset
+   __atomic_add_fetch(&trcgen,1,__ATOMIC_RELEASE);
 }
 
 //
-//  Send ICMP packet
+//  Set window size
 //
-void ICMP(int id,int seq,int ttl,struct sockaddr sa)
-{
-   char buf[256];
-   //  Set TTL
-   if (setsockopt(sock,IPPROTO_IP,IP_TTL,(void*)&ttl,sizeof(ttl))<0) Fatal("Cannot set TTL\n");
-   //  Set up ICMP packet header
-   struct icmphdr* icp = (struct icmphdr*)buf;
-   icp->type       = ICMP_ECHO;
-   icp->code       = 0;
-   icp->checksum   = 0;
-   icp->un.echo.id = id;
-   icp->un.echo.sequence = seq;
-   //  Set up the payload
-   double time = now();
-   int len = sizeof(struct icmphdr);
-   memcpy(buf+len,&time,sizeof(double));
-   len += sizeof(double);
-   //  Compute checksum
-   icp->checksum = checksum(buf,len);
-   //  Send packet
-   int i = sendto(sock,buf,len,0,&sa,sizeof(struct sockaddr));
-#ifdef __APPLE__
-   //  Some OSX machines inexplicably return -1
-   if (i>0 && i!=len) fprintf(stderr,"Failed to send ICMP packet\n");
-#else
-   if (i<0 || i!=len) fprintf(stderr,"Failed to send ICMP packet\n");
-#endif
+void Resize()
+{
+   int nx = hop ? nwid+9 : nwid+6;
+   if (tsmode) nx++;
+   if (showip) nx += awid + 1;
+   getmaxyx(stdscr,hgt,wid);
+   Scroll(0);
+   nping = wid - nx;
+   if (stat) nping -= 41;
+   if (nping>nsec) nping = nsec;
 }
 
 //
-//  Shift ping buffer
+//  Set color
 //
-void PingShift(Ping* ping,Stat* stat)
+void SetColor()
 {
-   //  Lost<0 means initialize
-   if (stat->lost<0)
-      stat->lost = 0;
-   //  Limit lost to 99999 to prevent field overflow
-   else if (GetPing(ping,0)==LostPing && stat->lost<99999)
-      stat->lost++;
-   //  Shift ping buffer
-   ping->cur--;
-   if (ping->cur<0) ping->cur += nsec;
-   //  Initialize as lost
-   SetPing(ping,0,LostPing);
+   if (white)
+   {
+      init_pair(1,COLOR_BLACK,COLOR_WHITE);
+      init_pair(2,COLOR_CYAN,COLOR_WHITE);
+      init_pair(3,COLOR_GREEN,COLOR_WHITE);
+      init_pair(4,COLOR_YELLOW,COLOR_WHITE);
+      init_pair(5,COLOR_RED,COLOR_WHITE);
+   }
+   else
+   {
+      init_pair(1,COLOR_WHITE,COLOR_BLACK);
+      init_pair(2,COLOR_CYAN,COLOR_BLACK);
+      init_pair(3,COLOR_GREEN,COLOR_BLACK);
+      init_pair(4,COLOR_YELLOW,COLOR_BLACK);
+      init_pair(5,COLOR_RED,COLOR_BLACK);
+   }
+   bkgd(COLOR_PAIR(1));
 }
 
 //
-//  Send ping to all targets
+//  Initialize curses
 //
-void* SendPing()
+void InitCurses()
 {
-   while (run)
-   {
-      total++;
-      //  Parallel traceroute
-      tseq++;
-      if (tseq>65535) tseq=nsec;
-      nhop = tTTL;
-      for (int k=0;k<tTTL;k++)
-      {
-         //  Initialize trace
-         tt[k].dt = 0;
-         tt[k].ip = 0;
-         PingShift(&tt[k].ping,&tt[k].stat);
-         //  Send Ping
-         ICMP(traceid,k+1,k+1,pt[sel].sa);
-         //  Pause before sending next
-         usleep(pus);
-      }
-      //  Write ping times
-      if (fout && seq)
-      {
-         time_t t =  time(NULL);
-         struct tm*  l = localtime(&t);
-         fprintf(fout,"%4d-%.2d-%.2d-%.2d:%.2d:%.2d",l->tm_year+1900,l->tm_mon+1,l->tm_mday,l->tm_hour,l->tm_min,l->tm_sec);
-         for (int i=0;i<ntar;i++)
-            fprintf(fout," %6.1f",pt[i].dt);
-         fprintf(fout,"\n");
-      }
-      //  Ping all targets with TTL pTTL
-      seq++;
-      if (seq>65535) seq=nsec;
-      for (int k=0;k<ntar;k++)
-      {
-         //  Advance ping array
-         PingShift(&pt[k].ping,&pt[k].stat);
-         // Send Ping
-         ICMP(pingid,seq,pTTL,pt[k].sa);
-         //  Pause before sending next
-         usleep(pus);
-      }
-      //  Pause until next second
-      usleep(950000-ntar*pus);
-      show = 1;
-      //  Give display 50ms to update
-      usleep((sbp-1)*1000000+50000);
-      //  Check if this is a finite ping
-      if (num>0 && seq>=num) run = 0;
-   }
-   return NULL;
+   // Start curses with raw input
+   initscr();
+   nonl(); cbreak(); noecho(); nodelay(stdscr,TRUE); keypad(stdscr,TRUE); curs_set(0);
+   //  Set colors
+   if (!has_colors()) Fatal("No color support\n");
+   start_color();
+   init_color(COLOR_WHITE,1000,1000,1000);
+   SetColor();
+   // Set window size
+   Resize();
 }
 
 //
-//  Unpack IP/ICMP header
+//  Initialize wiringPi
 //
-int UnpackHeader(unsigned char* data,int l,int* ttl,int* rtp,int* rcd, int* rid,int* rsq)
+#ifdef piGPIO
+void gpio(int pin,int level,uint32_t tick)
 {
-   int len=0;
-   //  Get TTL
-   if (l<sizeof(struct ip)) return 0;
-   struct ip* ip = (struct ip*)data;
-   *ttl = ip->ip_ttl;
-   //  Skip the IP header
-   int hlen = ip->ip_hl << 2;
-   data += hlen;
-   len  += hlen;
-   l    -= hlen;
-   //  Unpack ICMP header
-   if (l<sizeof(struct icmphdr)) return 0;
-   struct icmphdr* icp = (struct icmphdr*)data;
-   *rtp = icp->type;
-   *rcd = icp->code;
-   *rid = icp->un.echo.id;
-   *rsq = icp->un.echo.sequence;
-   data += sizeof(struct icmphdr);
-   len  += sizeof(struct icmphdr);
-   return len;
+   //  Ignore rapid interrupts (probably contact bounce)
+   double t = now();
+   if (t-swt<0.3) return;
+   //  Check for mapped pin
+   for (int k=0;k<4;k++)
+     if (pin==SW[k]) swx = k+1;
+   //  Remember time
+   if (swx) swt = t;
+}
+void InitPIgpio(void)
+{
+   //  Initialize piGPIO
+   if (gpioInitialise()<0) Fatal("Cannot initialize GPIO\n");
+   //  Set pins for input, pull-up and interrupt
+   for (int k=0;k<4;k++)
+   {
+      if (gpioSetMode(SW[k],PI_INPUT)) Fatal("Error setting SW%d to input\n",SW[k]);
+      if (gpioSetPullUpDown(SW[k],PI_PUD_UP)) Fatal("Error setting SW%d to pull-up\n",SW[k]);
+      if (gpioSetISRFunc(SW[k],FALLING_EDGE,-1,&gpio)) Fatal("Error setting interrupt for SW%d\n",SW[k]);
+   }
 }
+#endif
 
 //
-//  Encode time as byte
-//  Upper nibble exponent base 10
-//  Lower nibble mantissa 0-9
-//     Example 0x25 = 500
-//  Special values
-//     0xFF - NoPing
-//     0xFE - Lost ping
-//     0xFD - Late ping
+//  Set options of ICMP socket
 //
-uint8_t ByteTime(double dt)
+void SockOpt(int s)
 {
-   int idt = dt+0.5;
-   uint8_t bdt=LostPing;
-   if (idt<10)
-      bdt = idt;
-   else if (idt<100)
-      bdt = (idt/10) + 0x10;
-   else if (idt<1000)
-      bdt = (idt/100) + 0x20;
-   else if (idt<10000)
-      bdt = (idt/1000) + 0x30;
-   return bdt;
+   //  Default TTL is for pings
+   int ttl = pTTL;
+   if (setsockopt(s,IPPROTO_IP,IP_TTL,(void*)&ttl,sizeof(ttl))<0) Fatal("Cannot set TTL\n");
+   //  Receive buffer size
+   if (rcvbuf) SetRcvbuf(s);
+#ifdef __linux__
+   //  Kernel timestamps
+   if (tsmode) SetStamp(s);
+   //  Drop counter
+   SetDrop(s);
+#endif
 }
 
 //
-//  Update ping stats
+//  Open ICMP socket of worker
+//  The first worker also has the traceroute socket
 //
-void Stats(double dt,Stat* stat)
+void OpenSock(Worker* w)
 {
-   stat->n++;
-   stat->S  += dt;
-   stat->S2 += dt*dt;
-   if (stat->min<0 || dt<stat->min) stat->min = dt;
-   if (stat->max<0 || dt>stat->max) stat->max = dt;
-   stat->avg = stat->S / stat->n;
-   stat->std = (stat->n > 1) ? sqrt((stat->S2-stat->S*stat->S/stat->n)/(stat->n-1)) : 0;
+#ifdef __linux__
+   //  Ping sockets with a separate one for traceroute
+   if (dgram)
+   {
+      if ((w->sock=PingSock(&w->id))<0) Fatal("Cannot open ping socket\n");
+      if (w==worker && (tsock=PingSock(&traceid))<0) Fatal("Cannot open ping socket\n");
+   }
+   else
+#endif
+   //  Raw socket with the first also used for traceroute
+   {
+      w->sock = socket(AF_INET,SOCK_RAW,iproto);
+      if (w->sock<0) Fatal("Cannot open ICMP socket\n");
+#ifdef __linux__
+      SetFilter(w->sock,w->id,w==worker);
+#endif
+      if (w==worker) tsock = w->sock;
+   }
+   w->ttl = pTTL;
+   SockOpt(w->sock);
+   if (w==worker)
+   {
+      sock   = w->sock;
+      pingid = w->id;
+      //  A shared traceroute socket shares the TTL of the first worker
+      sttl = pTTL;
+      tttl = (tsock==sock) ? &w->ttl : &sttl;
+      if (tsock!=sock) SockOpt(tsock);
+   }
 }
 
 //
-//  Receive pings
+//  Init ICMP sockets
 //
-void* Receive()
+void InitSock()
 {
-   while (1)
+   sgen++;
+
+   //  Get unique IDs for ping and traceroute
+   //  Workers ping with consecutive even IDs
+   pingid = (getpid() & 0x7FFF) << 1;
+   traceid = pingid|0x01;
+   for (int w=0;w<nwk;w++)
+      worker[w].id = (pingid+2*w) & 0xFFFF;
+
+   //  ICMP protocol ID
+   struct protoent* proto = getprotobyname("icmp");
+   if (!proto) Fatal("icmp protocol not defined\n");
+   iproto = proto->p_proto;
+
+#ifdef __linux__
+   //  Use unprivileged ping sockets if they are allowed
+   dgram = 0;
+   if (kind!=1)
    {
-      unsigned char buf[8192];
-      unsigned char* data=buf;
-      //  Check for reply
-      struct sockaddr from;
-      socklen_t flen = sizeof(from);
-      int l = recvfrom(sock,buf,8192,0,&from,&flen);
-      if (l<0) continue;
-      //  Check if this packet is from a known host
-      struct sockaddr_in* isa = (struct sockaddr_in*)&from;
-      int host = -1;
-      for (int i=0;i<ntar && host<0;i++)
-         if (isa->sin_addr.s_addr==pt[i].ip.s_addr) host = i;
-      //  Unpack header
-      int ttl,rtp,rcd,rid,rsq;
-      int off = UnpackHeader(data,l,&ttl,&rtp,&rcd,&rid,&rsq);
-      if (!off) continue;
-      data += off;
-      l    -= off;
-      //  Process echo reply
-      if (rtp==ICMP_ECHOREPLY && l>=sizeof(double))
-      {
-         //  Calculate delay
-         double t0 = *(double*)data;
-         double dt = 1000*(now()-t0);
-         //  Ping reply from known host
-         if (rid==pingid && host>=0)
-         {
-            //  Current
-            if (rsq==seq)
-            {
-               pt[host].ttl = ttl;
-               pt[host].dt  = dt;
-               SetPing(&pt[host].ping,0,ByteTime(dt));
-               Stats(dt,&pt[host].stat);
-            }
-            //  Late
-            else
-            {
-               pt[host].stat.late++;
-               //  Offset in ping array
-               int k = seq-rsq;
-               //  Catch wrapping from 65535 to nsec
-               if (k<0) k += 65536-nsec;
-               //  Check offset in range and previously marked as lost
-               if (0<k && k<nsec && GetPing(&pt[host].ping,k)==LostPing)
-                  SetPing(&pt[host].ping,k,LatePing);
-            }
-         }
-         //  Traceroute reply
-         else if (rid==traceid && rsq>0 && rsq<=nhop)
-         {
-            //  Length of path
-            if (rsq<nhop) nhop = rsq;
-            tt[rsq-1].dt = dt;
-            tt[rsq-1].ip = isa->sin_addr.s_addr;
-            SetPing(&tt[rsq-1].ping,0,ByteTime(dt));
-            Stats(dt,&tt[rsq-1].stat);
-         }
-      }
-      //  Traceroute time exceeded
-      else if (rtp==ICMP_TIME_EXCEEDED)
-      {
-         //  Data is original packet
-         off = UnpackHeader(data,l,&ttl,&rtp,&rcd,&rid,&rsq);
-         if (!off) continue;
-         data += off;
-         l    -= off;
-         if (l<sizeof(double)) continue;
-         double t0 = *(double*)data;
-         double dt = 1000*(now()-t0);
-         if (rid==traceid && rsq>0 && rsq<=nhop)
-         {
-            tt[rsq-1].dt = dt;
-            tt[rsq-1].ip = isa->sin_addr.s_addr;
-            SetPing(&tt[rsq-1].ping,0,ByteTime(dt));
-            Stats(dt,&tt[rsq-1].stat);
-         }
-      }
-      //  Destination unreachable
-      else if (rtp==ICMP_UNREACH)
+      int s = socket(AF_INET,SOCK_DGRAM,IPPROTO_ICMP);
+      if (s>=0)
       {
-         //  Data is original packet
-         off = UnpackHeader(data,l,&ttl,&rtp,&rcd,&rid,&rsq);
-         if (!off) continue;
-         if (rid==traceid && rsq>0 && rsq<nhop)
-         {
-            nhop = rsq;
-            tt[rsq-1].dt = -1;
-            tt[rsq-1].ip = isa->sin_addr.s_addr;
-         }
+         dgram = 1;
+         close(s);
       }
+      if (!dgram && kind==2) Fatal("Cannot open ping socket (check net.ipv4.ping_group_range)\n");
    }
+#endif
+   for (int w=0;w<nwk;w++)
+      OpenSock(worker+w);
 }
 
 //
-//  Check that selected item is in range
-//  dir=0 is resizing the screen
+//  Replace the sockets of worker after a reset
+//  The sender moves to the new sockets at once but the receiver may be
+//  waiting on the old ones, so they are shut down to wake it and closed
+//  by the receiver (SockClose) so the descriptors cannot be reused under it
 //
-void Scroll(int dir)
+void SockReset(Worker* w)
 {
-   //  Everything fits
-   if (ntar+nhdr+1<hgt)
-      top = 0;
-   //  Ping mode scroll or resize
-   else if (!mode)
+#ifdef URING
+   //  Queued sends still name the old socket
+   if (xport)
+      while (srng.nsub) UringSubmit(&srng,0);
+#endif
+   w->old[0] = w->sock;
+   w->old[1] = (w==worker && tsock!=sock) ? tsock : -1;
+   OpenSock(w);
+   for (int i=0;i<2;i++)
+      if (w->old[i]>=0) shutdown(w->old[i],SHUT_RD);
+   __atomic_add_fetch(&sgen,1,__ATOMIC_RELEASE);
+   __atomic_store_n(&w->gen,w->gen+1,__ATOMIC_RELEASE);
+}
+
+//
+//  Close sockets of worker replaced by a reset and keep their drops
+//  Called by the receiver of the worker
+//
+void SockClose(Worker* w)
+{
+   int gen = __atomic_load_n(&w->gen,__ATOMIC_ACQUIRE);
+   if (gen==w->ogen) return;
+   for (int i=0;i<2;i++)
+      if (w->old[i]>=0) close(w->old[i]);
+   uint32_t n = w->drop;
+   w->drop = 0;
+   if (w==worker)
    {
-      //  Current bottom
-      int bot = Bottom(top);
-      // Scroll down
-      if (dir>0)
+      n += tdrop;
+      tdrop = 0;
+   }
+   __atomic_add_fetch(&bdrop,n,__ATOMIC_RELAXED);
+   __atomic_store_n(&w->ogen,gen,__ATOMIC_RELEASE);
+}
+
+//
+//  Apply a reset requested with the '0' key to worker
+//  The sender owns the statistics so it clears them under the sequence
+//  locks and opens new sockets
+//
+void Reset(Worker* w)
+{
+   int rst = __atomic_load_n(&rstgen,__ATOMIC_ACQUIRE);
+   for (int k=0;k<ntar;k++)
+      if (pt[k].wk==w-worker)
       {
-         for (int i=0;i<dir && Bottom(top)<ntar-1;i++)
-            bot = Bottom(++top);
+         SeqWrite(&pt[k].sq);
+         InitStat(&pt[k].stat);
+         SeqDone(&pt[k].sq);
       }
-      //  Scroll up
-      else if (dir<0)
+   if (w==worker)
+      for (int k=0;k<tTTL;k++)
+      {
+         SeqWrite(&tt[k].sq);
+         InitStat(&tt[k].stat);
+         SeqDone(&tt[k].sq);
+      }
+   SockReset(w);
+   w->rst = rst;
+}
+
+//
+//  Process key
+//  Returns 0 if the key does nothing
+//
+int Key(int ch)
+{
+   //  Quit
+   if (ch=='q')
+      run = 0;
+   //  Window resized
+   else if (ch==KEY_RESIZE)
+   {
+      Resize();
+      Display(0);
+   }
+   //  Reverse time one second
+   else if (ch==KEY_LEFT)
+   {
+      delt++;
+      Display(0);
+   }
+   //  Advance time one second
+   else if (ch==KEY_RIGHT && delt>0)
+   {
+      delt--;
+      Display(0);
+   }
+   //  Reverse time one minute
+   else if (ch=='-')
+   {
+      delt += 60;
+      Display(0);
+   }
+   //  Advance time one minte
+   else if (ch=='+')
+   {
+      delt -= 60;
+      if (delt<0) delt = 0;
+      Display(0);
+   }
+   //  Reverse time one hour or day
+   else if (ch=='<' || ch=='{')
+   {
+      delt += (ch=='<' ? 3600000 : 86400000)/col;
+      Display(0);
+   }
+   //  Advance time one hour or day
+   else if (ch=='>' || ch=='}')
+   {
+      delt -= (ch=='>' ? 3600000 : 86400000)/col;
+      if (delt<0) delt = 0;
+      Display(0);
+   }
+   //  Current time
+   else if (ch==KEY_END)
+   {
+      delt = 0;
+      Display(0);
+   }
+   //  Scroll down
+   else if (ch==KEY_NPAGE)
+   {
+      Scroll(+1);
+      Display(0);
+   }
+   //  Scroll up
+   else if (ch==KEY_PPAGE)
+   {
+      Scroll(-1);
+      Display(0);
+   }
+   //  Toggle mode
+   else if (swx==1)
+   {
+      swx = 0;
+      mode = !mode;
+      Display(0);
+   }
+   //  Previous target with scroll
+   else if (swx==2 || ch==KEY_UP)
+   {
+      swx = 0;
+      newsel(-1);
+      Display(0);
+   }
+   //  Next target with scroll
+   else if (swx==3 || ch==KEY_DOWN)
+   {
+      swx = 0;
+      newsel(+1);
+      Display(0);
+   }
+   //  Toggle display of addresses
+   else if (swx==4)
+   {
+      swx = 0;
+      showip = !showip;
+      Resize();
+      Display(0);
+   }
+   //  Switch to traceroute mode
+   else if (ch==KEY_ENTER || ch=='\n' || ch=='\r')
+   {
+      mode = !mode;
+      Display(0);
+   }
+   //  Switch to ping mode
+   else if (ch==27) // ESC
+   {
+      mode = 0;
+      Display(0);
+   }
+   //  Toggle hops in display
+   else if (ch=='n')
+   {
+      hop = 1-hop;
+      Resize();
+      Display(0);
+   }
+   //  Invert colors
+   else if (ch=='i')
+   {
+      white = !white;
+      SetColor();
+      Display(0);
+   }
+   //  Reverse ping display direction
+   else if (ch=='r')
+   {
+      r2l = !r2l;
+      Display(0);
+   }
+   //  Toggle display of addresses
+   else if (ch=='a')
+   {
+      showip = !showip;
+      Resize();
+      Display(0);
+   }
+   //  Toggle stats
+   else if (ch=='t')
+   {
+      stat = !stat;
+      Resize();
+      Display(0);
+   }
+   //  Cycle stats window
+   else if (ch=='w')
+   {
+      wsel = (wsel+1)%(NWIN+1);
+      if (!stat)
       {
-         top = top+dir>0 ? top+dir : 0;
-         bot = Bottom(top);
+         stat = 1;
+         Resize();
       }
-      //  Check that selection is on the screen
-      if (sel<top) sel = top;
-      if (sel>bot) sel = bot;
+      Display(0);
    }
-   //  Resize in traceroute mode
-   else if (!dir)
+   //  Toggle master silent
+   else if (ch=='S')
    {
-      //  Current bottom
-      int bot = Bottom(top);
-      //  Make sure that selection remains on the screen
-      if (sel<top) top = sel;
-      if (sel>bot) top -= sel-bot;
-      if (top<0) top = 0;
+      silent = !silent;
+      Display(0);
    }
-}
-
-//
-//  Select new target
-//
-void newsel(int dir)
-{
-   int new = sel+dir;
-   if (new<0)
-      new = 0;
-   else if (new>=ntar)
-      new = ntar-1;
-   //  Scroll up if required
-   if (dir<0)
+   //  Toggle silent
+   else if (ch=='s')
    {
-      while (new<top)
-        Scroll(-1);
+      pt[sel].silent = !pt[sel].silent;
+      Display(0);
    }
-   //  Scroll down if required
-   else
+   //  Show help
+   else if (ch=='h')
    {
-      while (new>Bottom(top))
-        Scroll(+1);
+      mode = -1;
+      Display(0);
    }
-   sel = new;
-   //  Reset traceroute hops when selected target changes
-   nhop = 0;
-   InitTrace();
+   //  Toggle ping character
+   else if (ch=='c')
+      ich = (ich+1)%4;
+   //  Reset ping socket and re-initialize statistics
+   //  The workers own the sockets and statistics so they do the reset
+   else if (ch=='0')
+   {
+      __atomic_add_fetch(&rstgen,1,__ATOMIC_RELEASE);
+      move(0,0);
+      printw("********RESET*******");
+      Display(0);
+   }
+   else
+      return 0;
+   return 1;
 }
 
+#ifdef __linux__
 //
-//  Set window size
+//  Add descriptor to epoll set
 //
-void Resize()
+void EventAdd(int ep,int fd,int events)
 {
-   int nx = hop ? nwid+9 : nwid+6;
-   if (showip) nx += awid + 1;
-   getmaxyx(stdscr,hgt,wid);
-   Scroll(0);
-   nping = wid - nx;
-   if (stat) nping -= 23;
-   if (nping>nsec) nping = nsec;
+   struct epoll_event ev;
+   memset(&ev,0,sizeof(ev));
+   ev.events  = events;
+   ev.data.fd = fd;
+   if (epoll_ctl(ep,EPOLL_CTL_ADD,fd,&ev)<0) Fatal("Cannot add descriptor to epoll\n");
 }
 
 //
-//  Set color
+//  Single threaded event loop
+//  Replies, send deadlines, keys and display updates are all events on one
+//  epoll descriptor so the program sleeps until there is something to do.
+//  When stopped, replies are received for 2 more seconds to catch stragglers.
 //
-void SetColor()
+void Events()
 {
-   if (white)
-   {
-      init_pair(1,COLOR_BLACK,COLOR_WHITE);
-      init_pair(2,COLOR_CYAN,COLOR_WHITE);
-      init_pair(3,COLOR_GREEN,COLOR_WHITE);
-      init_pair(4,COLOR_YELLOW,COLOR_WHITE);
-      init_pair(5,COLOR_RED,COLOR_WHITE);
-   }
-   else
+   int ep  = epoll_create1(0);
+   int tfd = timerfd_create(CLOCK_MONOTONIC,0);
+   efd = eventfd(0,EFD_NONBLOCK);
+   if (ep<0 || tfd<0 || efd<0) Fatal("Cannot create event loop\n");
+   EventAdd(ep,0,EPOLLIN);
+   EventAdd(ep,tfd,EPOLLIN);
+   EventAdd(ep,efd,EPOLLIN);
+#ifdef URING
+   if (xport) EventAdd(ep,rrng.fd,EPOLLIN);
+#endif
+   int gen=0;          //  Socket generation in the epoll set
+   int64_t next = -1;  //  Next send deadline
+   int64_t stop = -1;  //  End of loop after stopping
+   while (stop<0 || nsnow()<stop)
    {
-      init_pair(1,COLOR_WHITE,COLOR_BLACK);
-      init_pair(2,COLOR_CYAN,COLOR_BLACK);
-      init_pair(3,COLOR_GREEN,COLOR_BLACK);
-      init_pair(4,COLOR_YELLOW,COLOR_BLACK);
-      init_pair(5,COLOR_RED,COLOR_BLACK);
+      //  Sockets are replaced by a reset (closing removes the old ones)
+      //  With io_uring the sockets are only watched for the error queue
+      if (gen!=sgen)
+      {
+         int ev = xport ? 0 : EPOLLIN;
+         gen = sgen;
+         SockClose(worker);
+         EventAdd(ep,sock,ev);
+         if (tsock!=sock) EventAdd(ep,tsock,ev);
+#ifdef URING
+         if (xport) UringCheck();
+#endif
+      }
+      //  A reset or new traceroute target is applied by SendTick at once
+      if (worker->rst!=rstgen || worker->trc!=trcgen) next = -1;
+      //  Send pings and arm timer for the next deadline
+      if (run && next<0)
+      {
+         next = SendTick(worker);
+         struct itimerspec its;
+         memset(&its,0,sizeof(its));
+         its.it_value.tv_sec  = next/1000000000;
+         its.it_value.tv_nsec = next%1000000000;
+         if (timerfd_settime(tfd,TFD_TIMER_ABSTIME,&its,NULL)<0) Fatal("Cannot set timer\n");
+      }
+      //  Stopped by key or ping count
+      if (!run && stop<0) stop = nsnow()+2000000000LL;
+      //  Wait for events
+      struct epoll_event ev[16];
+      int n = epoll_wait(ep,ev,16,stop<0 ? -1 : (stop-nsnow())/1000000+1);
+      //  Window resize interrupts the wait and is read as a key
+      if (n<0 && errno==EINTR)
+      {
+         n = 0;
+         while (run && Key(getch()));
+      }
+      for (int i=0;i<n;i++)
+      {
+         int fd = ev[i].data.fd;
+         //  Timer expired
+         if (fd==tfd)
+         {
+            uint64_t k;
+            if (read(tfd,&k,sizeof(k))>0) next = -1;
+         }
+         //  Display update
+         else if (fd==efd)
+         {
+            uint64_t k;
+            if (read(efd,&k,sizeof(k))>0 && run && show) Display(1);
+         }
+         //  Keys
+         else if (fd==0)
+         {
+            while (run && Key(getch()));
+         }
+         //  Replies
+         else
+            RecvReady(fd,ev[i].events);
+      }
    }
-   bkgd(COLOR_PAIR(1));
+   close(tfd);
+   close(efd);
+   close(ep);
+   efd = -1;
 }
+#endif
 
 //
-//  Initialize curses
+//  Benchmark target lookup by IP address
+//  Time per lookup for the hash table should not grow with the number of
+//  targets while a linear scan grows in proportion
 //
-void InitCurses()
+void BenchHash()
 {
-   // Start curses with raw input
-   initscr();
-   nonl(); cbreak(); noecho(); nodelay(stdscr,TRUE); keypad(stdscr,TRUE); curs_set(0);
-   //  Set colors
-   if (!has_colors()) Fatal("No color support\n");
-   start_color();
-   init_color(COLOR_WHITE,1000,1000,1000);
-   SetColor();
-   // Set window size
-   Resize();
+   printf("%9s %10s %10s\n","Targets","Hash(ns)","Scan(ns)");
+   for (int n=10;n<=1000000;n*=10)
+   {
+      //  Consecutive addresses like a real subnet
+      in_addr_t* ip = (in_addr_t*)malloc(n*sizeof(in_addr_t));
+      if (!ip) Fatal("Cannot allocate addresses\n");
+      free(hash);
+      hash  = 0;
+      hbits = nhash = 0;
+      for (int i=0;i<n;i++)
+      {
+         ip[i] = htonl(0x0A000001+i);
+         HashAdd(ip[i],i);
+      }
+      //  Hash lookups in pseudo-random order
+      int m = 10000000;
+      uint32_t r=1;
+      long sum=0;
+      int64_t t0 = nsnow();
+      for (int k=0;k<m;k++)
+      {
+         r = 1664525*r+1013904223;
+         sum += HashFind(ip[r%n]);
+      }
+      double th = (double)(nsnow()-t0)/m;
+      //  Linear scan with fewer lookups for large n
+      m = n<1000 ? 1000000 : 1000000000/n;
+      if (m<100) m = 100;
+      t0 = nsnow();
+      for (int k=0;k<m;k++)
+      {
+         r = 1664525*r+1013904223;
+         in_addr_t a = ip[r%n];
+         for (int i=0;i<n;i++)
+            if (ip[i]==a)
+            {
+               sum += i;
+               break;
+            }
+      }
+      double ts = (double)(nsnow()-t0)/m;
+      printf("%9d %10.1f %10.1f\n",n,th,ts);
+      if (sum==42) printf("\n");
+      free(ip);
+   }
 }
 
+#ifdef __linux__
 //
-//  Initialize wiringPi
+//  Replies received so far
 //
-#ifdef piGPIO
-void gpio(int pin,int level,uint32_t tick)
+int BenchReplies()
 {
-   //  Ignore rapid interrupts (probably contact bounce)
-   double t = now();
-   if (t-swt<0.3) return;
-   //  Check for mapped pin
-   for (int k=0;k<4;k++)
-     if (pin==SW[k]) swx = k+1;
-   //  Remember time
-   if (swx) swt = t;
+   int n=0;
+   for (int k=0;k<ntar;k++)
+      n += pt[k].stat.n+pt[k].stat.late;
+   return n;
 }
-void InitPIgpio(void)
+
+//
+//  Benchmark transports on loopback
+//  Pings are sent to 4000 loopback addresses as fast as possible while
+//  replies are received in the same thread, as in the event loop
+//
+void BenchXport()
 {
-   //  Initialize piGPIO
-   if (gpioInitialise()<0) Fatal("Cannot initialize GPIO\n");
-   //  Set pins for input, pull-up and interrupt
-   for (int k=0;k<4;k++)
+   //  Loopback targets
+   ntar = 4000;
+   pt = (Target*)calloc(ntar,sizeof(Target));
+   tt = (Trace*)calloc(tTTL,sizeof(Trace));
+   int* list = (int*)malloc(ntar*sizeof(int));
+   if (!pt || !tt || !list) Fatal("Cannot allocate targets\n");
+   for (int k=0;k<ntar;k++)
    {
-      if (gpioSetMode(SW[k],PI_INPUT)) Fatal("Error setting SW%d to input\n",SW[k]);
-      if (gpioSetPullUpDown(SW[k],PI_PUD_UP)) Fatal("Error setting SW%d to pull-up\n",SW[k]);
-      if (gpioSetISRFunc(SW[k],FALLING_EDGE,-1,&gpio)) Fatal("Error setting interrupt for SW%d\n",SW[k]);
+      pt[k].ip.s_addr = htonl(0x7F030001+(k/250<<8)+k%250);
+      struct sockaddr_in* isa = (struct sockaddr_in*)&pt[k].sa;
+      isa->sin_family = AF_INET;
+      isa->sin_addr   = pt[k].ip;
+      list[k] = k;
+   }
+   evmode = 1;
+   if (nbat<64) nbat = 64;
+   if (!rcvbuf) rcvbuf = 16<<20;
+   printf("%-9s %10s %10s %8s %8s\n","Transport","Probes/s","Replies/s","Lost","Drops");
+   for (int x=0;x<2;x++)
+   {
+      char* name = x ? "io_uring" : "syscalls";
+      xport = x;
+      InitSock();
+      InitBatch();
+#ifdef URING
+      if (xport) InitUring();
+#endif
+      if (xport!=x)
+      {
+         printf("%-9s not available\n",name);
+         break;
+      }
+      for (int k=0;k<ntar;k++)
+         InitStat(&pt[k].stat);
+      bdrop = worker[0].drop = tdrop = 0;
+      //  Send rounds in batches and receive between batches
+      int nr = 50;
+      int64_t t0 = nsnow();
+      for (int r=0;r<nr;r++)
+         for (int i=0;i<ntar;i+=nbat)
+         {
+            ICMPbatch(worker,list+i,i+nbat<ntar ? nbat : ntar-i);
+            RecvPoll(0);
+         }
+      int64_t t1 = nsnow();
+      //  Wait for the rest of the replies
+      int n = BenchReplies();
+      int64_t tl = nsnow();
+      while (nsnow()-tl<200000000LL)
+      {
+         RecvPoll(10000000LL);
+         if (BenchReplies()>n)
+         {
+            n  = BenchReplies();
+            tl = nsnow();
+         }
+      }
+      printf("%-9s %10.0f %10.0f %8d %8u\n",name,1e9*nr*ntar/(t1-t0),1e9*n/(tl-t0),nr*ntar-n,Drops());
+      if (tsock!=sock) close(tsock);
+      close(sock);
    }
 }
 #endif
 
 //
-//  Init ICMP socket
+//  Run benchmark and exit
 //
-void InitSock(int init)
+void Bench(char* what)
 {
-   //  Close old socket
-   if (!init) close(sock);
-
-   //  Get unique IDs for ping and traceroute
-   pingid = (getpid() & 0x7FFF) << 1;
-   traceid = pingid|0x01;
-
-   //  ICMP protocol ID
-   struct protoent* proto = getprotobyname("icmp");
-   if (!proto) Fatal("icmp protocol not defined\n");
-
-   //  Set up socket
-   sock = socket(AF_INET,SOCK_RAW,proto->p_proto);
-   if (sock<0) Fatal("Cannot open ICMP socket\n");
-
-   //  Show reset
-   move(0,0);
-   printw("********RESET*******");
+   if (!strcmp(what,"hash"))
+      BenchHash();
+#ifdef __linux__
+   else if (!strcmp(what,"xport"))
+      BenchXport();
+#endif
+   else
+      Fatal("Unknown benchmark %s\n",what);
+   exit(0);
 }
 
 int main(int argc,char* argv[])
@@ -1316,7 +4481,19 @@ int main(int argc,char* argv[])
    int ch;
    int   nfile = 2;
    char* file[2] = {"cping.cfg","/etc/cping.cfg"};
-   while ((ch = getopt(argc,argv,"vbanrgxthSs:p:f:c:o:N:")) != EOF)
+   char* qfile = 0;
+   int64_t   qt0 = 0;
+   int64_t   qt1 = INT64_MAX;
+   in_addr_t qip = 0;
+   enum {OptFrom=256,OptTo,OptTarget};
+   struct option lopt[] =
+   {
+      {"from",  required_argument,NULL,OptFrom},
+      {"to",    required_argument,NULL,OptTo},
+      {"target",required_argument,NULL,OptTarget},
+      {NULL,0,NULL,0}
+   };
+   while ((ch = getopt_long(argc,argv,"vbanrgxthSELFs:p:f:c:o:N:m:w:j:I:T:R:B:X:W:H:D:A:Q:",lopt,NULL)) != EOF)
    {
        //  Black background
        if (ch == 'b')
@@ -1330,6 +4507,49 @@ int main(int argc,char* argv[])
        //  Microseconds between pings
        else if (ch == 'p')
           pus = atoi(optarg);
+       //  Length of ping history
+       else if (ch == 'H')
+       {
+          nsec = atoi(optarg);
+          if (nsec<100 || nsec>100000000) Fatal("Invalid -H %s\n",optarg);
+       }
+       //  Ping history in huge pages
+       else if (ch == 'L')
+          huge = 1;
+       //  16 bit log scale ping times
+       else if (ch == 'F')
+          fine = 1;
+       //  History file
+       else if (ch == 'D')
+          dbfile = optarg;
+       //  Archive file
+       else if (ch == 'A')
+          afile = optarg;
+       //  Query archive
+       else if (ch == 'Q')
+          qfile = optarg;
+       else if (ch == OptFrom)
+          qt0 = QueryTime(optarg);
+       else if (ch == OptTo)
+          qt1 = QueryTime(optarg);
+       else if (ch == OptTarget)
+       {
+          struct hostent* he = gethostbyname(optarg);
+          if (!he) Fatal("Cannot resolve host name %s\n",optarg);
+          memcpy(&qip,he->h_addr_list[0],4);
+       }
+       //  Sender/receiver worker pairs
+       else if (ch == 'W')
+       {
+          nwk = atoi(optarg);
+          if (nwk<1 || nwk>MAXWK) Fatal("Invalid -W %s\n",optarg);
+       }
+       //  Pings per batch
+       else if (ch == 'm')
+       {
+          nbat = atoi(optarg);
+          if (nbat<1) Fatal("Invalid -m %d\n",nbat);
+       }
        //  Show address
        else if (ch == 'a')
           showip = 1;
@@ -1342,8 +4562,84 @@ int main(int argc,char* argv[])
        //  Seconds beteen ping groups
        else if (ch == 's')
        {
-          sbp = atoi(optarg);
-          if (sbp<1 || sbp>5) Fatal("Invalid -s %d\n",sbp);
+          sbp = atof(optarg);
+          if (sbp<0.01 || sbp>5) Fatal("Invalid -s %s\n",optarg);
+       }
+       //  ICMP socket type
+       else if (ch == 'I')
+       {
+          if (!strcmp(optarg,"auto"))
+             kind = 0;
+          else if (!strcmp(optarg,"raw"))
+             kind = 1;
+          else if (!strcmp(optarg,"ping"))
+             kind = 2;
+          else
+             Fatal("Invalid -I %s\n",optarg);
+       }
+       //  Transport
+       else if (ch == 'X')
+       {
+          if (!strcmp(optarg,"sys"))
+             xport = 0;
+          else if (!strcmp(optarg,"uring"))
+             xport = 1;
+          else
+             Fatal("Invalid -X %s\n",optarg);
+#ifndef URING
+          if (xport) Fatal("io_uring not supported\n");
+#endif
+       }
+       //  Event loop
+       else if (ch == 'E')
+       {
+#ifdef __linux__
+          evmode = 1;
+#else
+          Fatal("Event loop requires Linux\n");
+#endif
+       }
+       //  Benchmark
+       else if (ch == 'B')
+          Bench(optarg);
+       //  Receive buffer size
+       else if (ch == 'R')
+       {
+          rcvbuf = 1024*atoi(optarg);
+          if (rcvbuf<=0) Fatal("Invalid -R %s\n",optarg);
+       }
+       //  Time source
+       else if (ch == 'T')
+       {
+          if (!strcmp(optarg,"user"))
+             tsmode = 0;
+          else if (!strcmp(optarg,"sw"))
+             tsmode = 1;
+          else if (!strcmp(optarg,"hw"))
+             tsmode = 2;
+          else
+             Fatal("Invalid -T %s\n",optarg);
+#ifndef __linux__
+          if (tsmode) Fatal("Kernel timestamps require Linux\n");
+#endif
+       }
+       //  Ping pacing
+       else if (ch == 'j')
+       {
+          if (!strcmp(optarg,"burst"))
+             pace = 0;
+          else if (!strcmp(optarg,"spread"))
+             pace = 1;
+          else if (!strcmp(optarg,"jitter"))
+             pace = 2;
+          else
+             Fatal("Invalid -j %s\n",optarg);
+       }
+       //  Seconds per display column
+       else if (ch == 'w')
+       {
+          sbc = atof(optarg);
+          if (sbc<1 || sbc>3600) Fatal("Invalid -w %s\n",optarg);
        }
        //  Ping character
        else if (ch == 'c')
@@ -1373,16 +4669,33 @@ int main(int argc,char* argv[])
        }
        //  Help
        else if (ch == 'h')
-          Fatal("Usage: cping [-vbanrgxthS] [-N count] [-p us] [-f file] [-o file]\n" 
+          Fatal("Usage: cping [-vbanrgxthSELF] [-N count] [-p us] [-m n] [-s sec] [-w sec] [-j pace] [-I sock] [-T time] [-R kB] [-B test] [-X xport]\n"
+                "             [-W workers] [-H pings] [-D file] [-A file] [-Q file] [-f file] [-o file]\n"
                 "  -b  White lettering on black background\n"
                 "  -a  Show address in ping table\n"
                 "  -n  No hops on ping table\n"
                 "  -r  Scroll pings left to right\n"
-                "  -p  microseconds between pings [default 1000]\n"
+                "  -p  microseconds between ping batches [default 1000]\n"
+                "  -m  pings per batch [default 1]\n"
                 "  -f  config file [default cping.cfg or /etc/cping.cfg]\n"
                 "  -o  output file\n"
                 "  -N  Stop after this many pings\n"
-                "  -s  seconds between ping\n"
+                "  -s  seconds between ping (0.01-5)\n"
+                "  -w  seconds per display column [default max(1,-s)]\n"
+                "  -j  ping pacing burst|spread|jitter [default burst]\n"
+                "  -I  ICMP socket auto|raw|ping [default auto]\n"
+                "  -T  time source user|sw|hw [default user]\n"
+                "  -R  socket receive buffer in kB\n"
+                "  -B  run benchmark hash|xport and exit\n"
+                "  -X  transport sys|uring [default sys]\n"
+                "  -E  single threaded event loop\n"
+                "  -W  sender/receiver worker pairs [default 1]\n"
+                "  -H  pings of history [default 3600]\n"
+                "  -L  ping history in huge pages\n"
+                "  -F  16 bit log scale ping times in history\n"
+                "  -D  history file to continue after a restart\n"
+                "  -A  archive file of the worst ping per column\n"
+                "  -Q  print archive [--from time] [--to time] [--target host]\n"
                 "  -S  silent\n"
                 "  -x  show numeric ping character\n"
                 "  -t  show ping time stats\n"
@@ -1404,201 +4717,95 @@ int main(int argc,char* argv[])
        else
           Fatal("Unknown option %c\n",ch);
    }
+   //  Ping interval rounded to the wheel tick
+   pint = WTICK*(int)(1000*sbp/WTICK+0.5);
+   //  Display columns are one ping period but at least a second
+   //  so faster pings are aggregated
+   col = sbc>0 ? 1000*sbc+0.5 : pint<1000 ? 1000 : pint;
+   //  Query archive and exit
+   if (qfile)
+   {
+      Query(qfile,qt0,qt1,qip);
+      return 0;
+   }
    //  Read data
    ReadConfig(file,nfile);
-   if (pus*(ntar+tTTL)>950000) Fatal("Pause length exceeds one second\n");
+   InitHistory();
+   if (afile) OpenArchive();
+   //  Each worker pings a contiguous slice of the targets
+   if (nwk>1 && (evmode || xport)) Fatal("-W cannot be combined with -E or -X uring\n");
+   if (nwk>ntar) nwk = ntar;
+   for (int k=0;k<ntar;k++)
+      pt[k].wk = (int64_t)k*nwk/ntar;
+   if (pus*((ntar+nbat-1)/nbat+tTTL)>950000) Fatal("Pause length exceeds one second\n");
+   for (int k=0;k<ntar;k++)
+      if ((int64_t)pus*((ntar+nbat-1)/nbat)>(int64_t)1000*pt[k].ivl) Fatal("Pause length exceeds ping interval of %s\n",pt[k].name);
    //  Initialize curses
    InitCurses();
    //  Initialize ICMP socket
-   InitSock(1);
+   InitSock();
+   //  Initialize packet templates and ping batches
+   InitBatch();
+#ifdef URING
+   if (xport) InitUring();
+#endif
+   InitWheel();
+   //  History times follow the real time
+   struct timespec ts;
+   clock_gettime(CLOCK_REALTIME,&ts);
+   epoch = ts.tv_sec*1000000000LL + ts.tv_nsec - nsnow();
    //  Initialize DNS
    InitDNS();
-   //  Start read thread
-   if (pthread_create(&rd,NULL,Receive,NULL)) Fatal("Cannot start receive thread\n");
-   //  Start write thread
-   if (pthread_create(&rd,NULL,SendPing,NULL)) Fatal("Cannot start write thread\n");
-   //  Main loop
-   while(run)
-   {
-      int ch = getch();
-      //  Quit
-      if (ch=='q')
-         run = 0;
-      //  Window resized
-      else if (ch==KEY_RESIZE)
-      {
-         Resize();
-         Display(0);
-      }
-      //  Reverse time one second
-      else if (ch==KEY_LEFT)
-      {
-         delt++;
-         Display(0);
-      }
-      //  Advance time one second
-      else if (ch==KEY_RIGHT && delt>0)
-      {
-         delt--;
-         Display(0);
-      }
-      //  Reverse time one minute
-      else if (ch=='-')
-      {
-         delt += 60;
-         Display(0);
-      }
-      //  Advance time one minte
-      else if (ch=='+')
-      {
-         delt -= 60;
-         if (delt<0) delt = 0;
-         Display(0);
-      }
-      //  Current time
-      else if (ch==KEY_END)
-      {
-         delt = 0;
-         Display(0);
-      }
-      //  Scroll down
-      else if (ch==KEY_NPAGE)
-      {
-         Scroll(+1);
-         Display(0);
-      }
-      //  Scroll up
-      else if (ch==KEY_PPAGE)
-      {
-         Scroll(-1);
-         Display(0);
-      }
-      //  Toggle mode
-      else if (swx==1)
-      {
-         swx = 0;
-         mode = !mode;
-         Display(0);
-      }
-      //  Previous target with scroll
-      else if (swx==2 || ch==KEY_UP)
-      {
-         swx = 0;
-         newsel(-1);
-         Display(0);
-      }
-      //  Next target with scroll
-      else if (swx==3 || ch==KEY_DOWN)
-      {
-         swx = 0;
-         newsel(+1);
-         Display(0);
-      }
-      //  Toggle display of addresses
-      else if (swx==4)
-      {
-         swx = 0;
-         showip = !showip;
-         Resize();
-         Display(0);
-      }
-      //  Switch to traceroute mode
-      else if (ch==KEY_ENTER || ch=='\n' || ch=='\r')
-      {
-         mode = !mode;
-         Display(0);
-      }
-      //  Switch to ping mode
-      else if (ch==27) // ESC
-      {
-         mode = 0;
-         Display(0);
-      }
-      //  Toggle hops in display
-      else if (ch=='n')
-      {
-         hop = 1-hop;
-         Resize();
-         Display(0);
-      }
-      //  Invert colors
-      else if (ch=='i')
-      {
-         white = !white;
-         SetColor();
-         Display(0);
-      }
-      //  Reverse ping display direction
-      else if (ch=='r')
-      {
-         r2l = !r2l;
-         Display(0);
-      }
-      //  Toggle display of addresses
-      else if (ch=='a')
-      {
-         showip = !showip;
-         Resize();
-         Display(0);
-      }
-      //  Toggle stats
-      else if (ch=='t')
-      {
-         stat = !stat;
-         Resize();
-         Display(0);
-      }
-      //  Toggle master silent
-      else if (ch=='S')
-      {
-         silent = !silent;
-         Display(0);
-      }
-      //  Toggle silent
-      else if (ch=='s')
-      {
-         pt[sel].silent = !pt[sel].silent;
-         Display(0);
-      }
-      //  Show help
-      else if (ch=='h')
+   //  Pings and columns are scheduled from here
+   origin = nsnow();
+   //  Start archive writer
+   if (afile && pthread_create(&arw,NULL,Archive,NULL)) Fatal("Cannot start archive thread\n");
+#ifdef __linux__
+   //  Event loop
+   if (evmode)
+      Events();
+   else
+#endif
+   {
+      //  Start read and write threads for each worker
+      for (int w=0;w<nwk;w++)
       {
-         mode = -1;
-         Display(0);
+         if (pthread_create(&worker[w].rcv,NULL,Receive,worker+w)) Fatal("Cannot start receive thread\n");
+         if (pthread_create(&worker[w].snd,NULL,SendPing,worker+w)) Fatal("Cannot start write thread\n");
       }
-      //  Toggle ping character
-      else if (ch=='c')
-         ich = (ich+1)%4;
-      //  Reset ping socket and re-initialize statistics
-      else if (ch=='0')
+      //  Main loop
+      while(run)
       {
-         InitSock(0);
-         for (int k=0;k<tTTL;k++)
-            InitStat(&tt[k].stat);
-         for (int k=0;k<ntar;k++)
-            InitStat(&pt[k].stat);
-         Display(0);
+         //  Process key or update display
+         if (!Key(getch()) && show)
+            Display(1);
+         //  Sleep 1ms
+         usleep(1000);
       }
-      //  Update display
-      else if (show)
-         Display(1);
-      //  Sleep 1ms
-      usleep(1000);
+      //  Main thread owns the state once the senders stop
+      for (int w=0;w<nwk;w++)
+         pthread_join(worker[w].snd,NULL);
    }
+   if (afile) pthread_join(arw,NULL);
    endwin();
+   if (nouring) fprintf(stderr,"io_uring not available, used system calls\n");
 #ifdef piGPIO
    gpioTerminate();
 #endif
    //  Write starts to end of output file
    if (fout)
    {
-      //  Allow Receive to catch stragglers
-      sleep(2);
+      //  Allow Receive to catch stragglers (the event loop already has)
+      if (!evmode) sleep(2);
+      for (int w=0;w<nwk;w++)
+         Drain(worker+w);
       fprintf(fout,"END Total pings %d\n",total);
+      fprintf(fout,"Receive drops %u\n",Drops());
       //  Finalize lost count
       for (int k=0;k<ntar;k++)
-         if (GetPing(&pt[k].ping,0)==LostPing && pt[k].stat.lost<99999)
-            pt[k].stat.lost++;
+         for (int i=0;i<pt[k].ping.pend;i++)
+            if (GetPing(&pt[k].ping,i)==LostPing && pt[k].stat.lost<99999)
+               pt[k].stat.lost++;
       //  Print statistics
       fprintf(fout,"Replies            ");
       for (int i=0;i<ntar;i++)
@@ -1628,6 +4835,33 @@ int main(int argc,char* argv[])
       for (int i=0;i<ntar;i++)
          fprintf(fout," %6.1f",pt[i].stat.std);
       fprintf(fout,"\n");
+      //  Percentiles
+      double pq[] = {0.5,0.95,0.99};
+      for (int k=0;k<3;k++)
+      {
+         fprintf(fout,"p%-18d",(int)(100*pq[k]+0.5));
+         for (int i=0;i<ntar;i++)
+            fprintf(fout," %6.1f",Quantile(&pt[i].stat,pq[k]));
+         fprintf(fout,"\n");
+      }
+      //  All targets combined
+      Stat all;
+      InitStat(&all);
+      for (int i=0;i<ntar;i++)
+         MergeStat(&all,&pt[i].stat);
+      fprintf(fout,"All targets         p50 %.1f p95 %.1f p99 %.1f\n",Quantile(&all,0.5),Quantile(&all,0.95),Quantile(&all,0.99));
+      //  Replies by time source
+      if (tsmode)
+      {
+         char* name[] = {"User time","Kernel receive","Kernel software","Hardware"};
+         for (int k=0;k<4;k++)
+         {
+            fprintf(fout,"%-19s",name[k]);
+            for (int i=0;i<ntar;i++)
+               fprintf(fout," %6d",pt[i].stat.nsrc[k]);
+            fprintf(fout,"\n");
+         }
+      }
       fclose(fout);
    }
    return 0;